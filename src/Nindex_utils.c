@@ -0,0 +1,252 @@
+/****************************************************************************
+ *                     Native normalization of subscripts                   *
+ ****************************************************************************/
+#include "Nindex_utils.h"
+
+#include <limits.h>  /* for INT_MAX */
+
+/*
+  C_normalize_subscript() normalizes a subscript along a dimension of
+  extent 'd'. The subscript can be a logical, integer, double, or character
+  vector (or NULL), with the same semantic as with `[`, except that:
+    o NAs are not allowed;
+    o positive indices must be <= 'd' (but negative indices < -d are
+      ignored like with `[`);
+    o a logical subscript cannot be longer than 'd' unless all its
+      extra values are FALSE;
+    o a character subscript requires 'names'.
+
+  The normalized subscript is returned in a compact form that preserves
+  ranges, as a list of 2 elements: a "kind" (single integer) and a "value"
+  (integer vector). The "kind" is one of:
+    o FULL:     The subscript selects all the positions along the dimension,
+                in order. 'value' is NULL.
+    o RANGE:    The subscript is a range of at least 2 consecutive positions
+                in ascending order. 'value' is 'c(start, end)'.
+    o INDICES:  'value' contains the selected positions, in the order in
+                which they are selected.
+  Note that the subscript is never expanded when it is a range (or a full
+  range), even when it's supplied as a logical vector or a vector of
+  negative indices.
+*/
+
+#define	FULL_SUBSCRIPT      0
+#define	RANGE_SUBSCRIPT     1
+#define	INDICES_SUBSCRIPT   2
+
+static SEXP new_normalized_subscript(int kind, SEXP value)
+{
+	SEXP ans, ans_elt;
+
+	ans = PROTECT(NEW_LIST(2));
+	ans_elt = PROTECT(ScalarInteger(kind));
+	SET_VECTOR_ELT(ans, 0, ans_elt);
+	UNPROTECT(1);
+	SET_VECTOR_ELT(ans, 1, value);
+	UNPROTECT(1);
+	return ans;
+}
+
+static SEXP new_range_subscript(int start, int end)
+{
+	SEXP value, ans;
+
+	value = PROTECT(NEW_INTEGER(2));
+	INTEGER(value)[0] = start;
+	INTEGER(value)[1] = end;
+	ans = new_normalized_subscript(RANGE_SUBSCRIPT, value);
+	UNPROTECT(1);
+	return ans;
+}
+
+/* Walk on 'mask' (of length 'd') to collect the selected positions. */
+static SEXP normalize_mask(const char *mask, int d)
+{
+	int nsel, nrun, start, k, i;
+	SEXP value, ans;
+
+	nsel = nrun = start = 0;
+	for (k = 0; k < d; k++) {
+		if (!mask[k])
+			continue;
+		if (nsel == 0)
+			start = k + 1;
+		if (k == 0 || !mask[k - 1])
+			nrun++;
+		nsel++;
+	}
+	if (nsel == d)
+		return new_normalized_subscript(FULL_SUBSCRIPT, R_NilValue);
+	if (nrun == 1 && nsel >= 2)
+		return new_range_subscript(start, start + nsel - 1);
+	value = PROTECT(NEW_INTEGER(nsel));
+	for (k = i = 0; k < d; k++)
+		if (mask[k])
+			INTEGER(value)[i++] = k + 1;
+	ans = new_normalized_subscript(INDICES_SUBSCRIPT, value);
+	UNPROTECT(1);
+	return ans;
+}
+
+static SEXP normalize_logical_subscript(SEXP subscript, int d)
+{
+	R_xlen_t n, k;
+	const int *s;
+	char *mask;
+	int v;
+
+	n = XLENGTH(subscript);
+	s = LOGICAL(subscript);
+	for (k = 0; k < n; k++) {
+		v = s[k];
+		if (v == NA_LOGICAL)
+			error("subscript contains NAs");
+		if (k >= d && v)
+			error("subscript is a logical vector with "
+			      "out-of-bounds TRUE values");
+	}
+	mask = (char *) R_alloc(d, sizeof(char));
+	for (k = 0; k < d; k++)
+		mask[k] = n == 0 ? 0 : (s[k % n] != 0);
+	return normalize_mask(mask, d);
+}
+
+/* Get the 'k'-th index from a numeric subscript, truncated toward 0 like
+   `[` does with non-integer values. Values that are < -d are returned
+   as -d - 1. */
+static inline long long int get_index(SEXP subscript, R_xlen_t k, int d)
+{
+	int iv;
+	double dv;
+
+	if (IS_INTEGER(subscript)) {
+		iv = INTEGER(subscript)[k];
+		if (iv == NA_INTEGER)
+			error("subscript contains NAs");
+		return (long long int) iv;
+	}
+	dv = REAL(subscript)[k];
+	if (ISNAN(dv))
+		error("subscript contains NAs");
+	if (dv >= (double) d + 1.0)
+		error("subscript contains out-of-bounds indices");
+	if (dv <= -((double) d + 1.0))
+		return -(long long int) d - 1;
+	return (long long int) dv;
+}
+
+/* 'subscript' must be a numeric (integer or double) vector. */
+static SEXP normalize_numeric_subscript(SEXP subscript, int d)
+{
+	R_xlen_t n, k, i;
+	long long int x, prev;
+	int npos, nneg, is_range, start;
+	char *mask;
+	SEXP value, ans;
+
+	n = XLENGTH(subscript);
+	npos = nneg = 0;
+	is_range = 1;
+	start = 0;
+	prev = 0;
+	for (k = 0; k < n; k++) {
+		x = get_index(subscript, k, d);
+		if (x < 0) {
+			nneg = 1;
+			continue;
+		}
+		if (x == 0)
+			continue;
+		if (x > d)
+			error("subscript contains out-of-bounds indices");
+		if (npos == 0) {
+			start = (int) x;
+		} else if (x != prev + 1) {
+			is_range = 0;
+		}
+		prev = x;
+		if (npos == INT_MAX)
+			error("subscript is too long");
+		npos++;
+	}
+	if (nneg) {
+		/* Negative subscript. */
+		if (npos != 0)
+			error("subscript contains both positive "
+			      "and negative indices");
+		mask = (char *) R_alloc(d, sizeof(char));
+		for (k = 0; k < d; k++)
+			mask[k] = 1;
+		for (k = 0; k < n; k++) {
+			x = get_index(subscript, k, d);
+			/* Negative indices < -d are ignored. */
+			if (x != 0 && x >= -d)
+				mask[-x - 1] = 0;
+		}
+		return normalize_mask(mask, d);
+	}
+	if (is_range && npos == d)
+		return new_normalized_subscript(FULL_SUBSCRIPT, R_NilValue);
+	if (is_range && npos >= 2)
+		return new_range_subscript(start, start + npos - 1);
+	value = PROTECT(NEW_INTEGER(npos));
+	for (k = i = 0; k < n; k++) {
+		x = get_index(subscript, k, d);
+		if (x != 0)
+			INTEGER(value)[i++] = (int) x;
+	}
+	ans = new_normalized_subscript(INDICES_SUBSCRIPT, value);
+	UNPROTECT(1);
+	return ans;
+}
+
+static SEXP normalize_character_subscript(SEXP subscript, int d, SEXP names)
+{
+	R_xlen_t n, k;
+	SEXP m, ans;
+
+	if (names == R_NilValue)
+		error("subscript is a character vector but there are "
+		      "no names along the dimension to subset");
+	if (!IS_CHARACTER(names) || LENGTH(names) != d)
+		error("'names' must be NULL or a character vector "
+		      "of length 'd'");
+	n = XLENGTH(subscript);
+	for (k = 0; k < n; k++)
+		if (STRING_ELT(subscript, k) == NA_STRING)
+			error("subscript contains NAs");
+	/* match() uses a hash table. */
+	m = PROTECT(match(names, subscript, NA_INTEGER));
+	for (k = 0; k < n; k++)
+		if (INTEGER(m)[k] == NA_INTEGER)
+			error("subscript contains invalid names");
+	ans = normalize_numeric_subscript(m, d);
+	UNPROTECT(1);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_normalize_subscript(SEXP subscript, SEXP d, SEXP names)
+{
+	int d0;
+
+	if (!IS_INTEGER(d) || LENGTH(d) != 1)
+		error("'d' must be a single integer");
+	d0 = INTEGER(d)[0];
+	if (d0 == NA_INTEGER || d0 < 0)
+		error("'d' must be a non-negative integer");
+	switch (TYPEOF(subscript)) {
+	    case NILSXP:
+		/* A NULL subscript is treated like integer(0). */
+		return normalize_numeric_subscript(subscript, d0);
+	    case LGLSXP:
+		return normalize_logical_subscript(subscript, d0);
+	    case INTSXP: case REALSXP:
+		return normalize_numeric_subscript(subscript, d0);
+	    case STRSXP:
+		return normalize_character_subscript(subscript, d0, names);
+	}
+	error("invalid subscript type");
+	return R_NilValue;  /* will never reach this */
+}
+
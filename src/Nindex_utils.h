@@ -0,0 +1,12 @@
+#ifndef _NINDEX_UTILS_H_
+#define _NINDEX_UTILS_H_
+
+#include <Rdefines.h>
+
+SEXP C_normalize_subscript(
+	SEXP subscript,
+	SEXP d,
+	SEXP names
+);
+
+#endif  /* _NINDEX_UTILS_H_ */
@@ -0,0 +1,958 @@
+/****************************************************************************
+ *         Run-length/bitmap representation of array selections             *
+ ****************************************************************************/
+#include "RLindex_utils.h"
+
+#include "array_selection.h"  /* for safe_dim_prod() and INVALID_COORD() */
+
+#include <limits.h>  /* for INT_MAX */
+#include <stdlib.h>  /* for qsort() */
+#include <string.h>  /* for memcpy(), memset() */
+
+/*
+  A run-length linear index (also called "RLindex") is a compact
+  representation of the set of array elements selected by an Lindex
+  (see array_selection.c). Unlike an Lindex, an RLindex is always sorted
+  and has no duplicates. It is made of:
+
+  - Runs of consecutive linear indices, stored as (start, width) pairs.
+
+  - Bitmap tiles: the linear index space is divided into tiles of TILE_NBIT
+    consecutive positions, and a tile that would need more than
+    MAX_TILE_NRUN runs is stored as a bitmap of TILE_NWORD 32-bit words
+    instead.
+
+  Runs and bitmap tiles never overlap. At the R level, an RLindex object
+  stores its parts in 5 slots. At the C level, these slots are passed
+  around as a list (the "parts"):
+    1. run_start:  double vector of 1-based run starts, sorted;
+    2. run_width:  double vector of run widths;
+    3. tile_start: double vector of 1-based tile starts, sorted;
+    4. tile_bits:  integer vector of length TILE_NWORD * length(tile_start);
+    5. nselected:  the total number of selected elements (a double).
+  Note that runs can be adjacent to the boundaries of a bitmap tile.
+*/
+
+#define TILE_NBIT 4096
+#define TILE_NWORD (TILE_NBIT / 32)
+
+/* A run is stored as 2 doubles (16 bytes) and a bitmap tile takes 512 bytes
+   so the bitmap is the most compact representation of a tile as soon as it
+   contains more than 32 runs. */
+#define MAX_TILE_NRUN 32
+
+
+/****************************************************************************
+ * RLBuilder: builds an RLindex from a stream of runs
+ *
+ * The runs must be added in increasing order and cannot overlap, but they
+ * can be adjacent (in which case they get merged).
+ * All the memory is allocated with R_alloc() so is released at the end of
+ * the .Call() even if an error is raised.
+ */
+
+typedef struct rl_builder_t {
+	long long int *run_start;  /* 0-based */
+	long long int *run_width;
+	R_xlen_t nrun, run_buflen;
+	long long int *tile_id;
+	unsigned int *tile_words;
+	R_xlen_t ntile, tile_buflen;
+	long long int nselected;
+	/* The tile currently being filled. */
+	long long int cur_tile;    /* -1 if none */
+	int cur_npiece;            /* -1 if turned into a bitmap */
+	long long int piece_start[MAX_TILE_NRUN];
+	long long int piece_width[MAX_TILE_NRUN];
+} RLBuilder;
+
+static void *grow_buf(void *buf, size_t old_nbyte, size_t new_nbyte)
+{
+	void *new_buf;
+
+	new_buf = (void *) R_alloc(new_nbyte, 1);
+	if (old_nbyte != 0)
+		memcpy(new_buf, buf, old_nbyte);
+	return new_buf;
+}
+
+static void RLBuilder_init(RLBuilder *b)
+{
+	memset(b, 0, sizeof(RLBuilder));
+	b->cur_tile = -1;
+	return;
+}
+
+static void append_run(RLBuilder *b, long long int start, long long int width)
+{
+	R_xlen_t n, new_buflen;
+
+	n = b->nrun;
+	if (n != 0 && b->run_start[n - 1] + b->run_width[n - 1] == start) {
+		b->run_width[n - 1] += width;
+		return;
+	}
+	if (n == b->run_buflen) {
+		new_buflen = n == 0 ? 64 : 2 * n;
+		b->run_start = grow_buf(b->run_start,
+					sizeof(long long int) * n,
+					sizeof(long long int) * new_buflen);
+		b->run_width = grow_buf(b->run_width,
+					sizeof(long long int) * n,
+					sizeof(long long int) * new_buflen);
+		b->run_buflen = new_buflen;
+	}
+	b->run_start[n] = start;
+	b->run_width[n] = width;
+	b->nrun++;
+	return;
+}
+
+static unsigned int *append_tile(RLBuilder *b, long long int tile)
+{
+	R_xlen_t n, new_buflen;
+	unsigned int *words;
+
+	n = b->ntile;
+	if (n == b->tile_buflen) {
+		new_buflen = n == 0 ? 8 : 2 * n;
+		b->tile_id = grow_buf(b->tile_id,
+				      sizeof(long long int) * n,
+				      sizeof(long long int) * new_buflen);
+		b->tile_words = grow_buf(b->tile_words,
+				sizeof(unsigned int) * TILE_NWORD * n,
+				sizeof(unsigned int) * TILE_NWORD * new_buflen);
+		b->tile_buflen = new_buflen;
+	}
+	words = b->tile_words + TILE_NWORD * n;
+	memset(words, 0, sizeof(unsigned int) * TILE_NWORD);
+	b->tile_id[n] = tile;
+	b->ntile++;
+	return words;
+}
+
+static void set_bits(unsigned int *words, int from, int nbit)
+{
+	int k;
+
+	for (k = from; k < from + nbit; k++)
+		words[k >> 5] |= 1U << (k & 31);
+	return;
+}
+
+/* Emit the pieces of the current tile as runs (unless the tile was turned
+   into a bitmap, in which case it's already stored). */
+static void flush_tile(RLBuilder *b)
+{
+	int k;
+
+	for (k = 0; k < b->cur_npiece; k++)
+		append_run(b, b->piece_start[k], b->piece_width[k]);
+	b->cur_tile = -1;
+	b->cur_npiece = 0;
+	return;
+}
+
+/* The piece must fall within the current tile. */
+static void add_piece(RLBuilder *b, long long int start, long long int width)
+{
+	long long int tile_off;
+	unsigned int *words;
+	int n, k;
+
+	tile_off = b->cur_tile * TILE_NBIT;
+	n = b->cur_npiece;
+	if (n >= 0) {
+		if (n != 0 &&
+		    b->piece_start[n - 1] + b->piece_width[n - 1] == start)
+		{
+			b->piece_width[n - 1] += width;
+			return;
+		}
+		if (n < MAX_TILE_NRUN) {
+			b->piece_start[n] = start;
+			b->piece_width[n] = width;
+			b->cur_npiece++;
+			return;
+		}
+		/* Too many runs in this tile: switch to a bitmap. */
+		words = append_tile(b, b->cur_tile);
+		for (k = 0; k < n; k++)
+			set_bits(words, (int) (b->piece_start[k] - tile_off),
+					(int) b->piece_width[k]);
+		b->cur_npiece = -1;
+	} else {
+		words = b->tile_words + TILE_NWORD * (b->ntile - 1);
+	}
+	set_bits(words, (int) (start - tile_off), (int) width);
+	return;
+}
+
+/* 'start' is 0-based. */
+static void RLBuilder_add_run(RLBuilder *b,
+			      long long int start, long long int width)
+{
+	long long int tile, w;
+
+	b->nselected += width;
+	while (width > 0) {
+		tile = start / TILE_NBIT;
+		if (tile != b->cur_tile) {
+			flush_tile(b);
+			if (start % TILE_NBIT == 0 && width >= TILE_NBIT) {
+				/* The run covers one or more full tiles. */
+				w = width / TILE_NBIT * TILE_NBIT;
+				append_run(b, start, w);
+				start += w;
+				width -= w;
+				continue;
+			}
+			b->cur_tile = tile;
+		}
+		w = (tile + 1) * TILE_NBIT - start;
+		if (w > width)
+			w = width;
+		add_piece(b, start, w);
+		start += w;
+		width -= w;
+	}
+	return;
+}
+
+static SEXP RLBuilder_finish(RLBuilder *b)
+{
+	SEXP ans, ans_elt;
+	R_xlen_t k;
+
+	flush_tile(b);
+	ans = PROTECT(NEW_LIST(5));
+
+	ans_elt = PROTECT(NEW_NUMERIC(b->nrun));
+	for (k = 0; k < b->nrun; k++)
+		REAL(ans_elt)[k] = (double) b->run_start[k] + 1.0;
+	SET_VECTOR_ELT(ans, 0, ans_elt);
+	UNPROTECT(1);
+
+	ans_elt = PROTECT(NEW_NUMERIC(b->nrun));
+	for (k = 0; k < b->nrun; k++)
+		REAL(ans_elt)[k] = (double) b->run_width[k];
+	SET_VECTOR_ELT(ans, 1, ans_elt);
+	UNPROTECT(1);
+
+	ans_elt = PROTECT(NEW_NUMERIC(b->ntile));
+	for (k = 0; k < b->ntile; k++)
+		REAL(ans_elt)[k] = (double) b->tile_id[k] * TILE_NBIT + 1.0;
+	SET_VECTOR_ELT(ans, 2, ans_elt);
+	UNPROTECT(1);
+
+	ans_elt = PROTECT(NEW_INTEGER(TILE_NWORD * b->ntile));
+	if (b->ntile != 0)
+		memcpy(INTEGER(ans_elt), b->tile_words,
+		       sizeof(unsigned int) * TILE_NWORD * b->ntile);
+	SET_VECTOR_ELT(ans, 3, ans_elt);
+	UNPROTECT(1);
+
+	ans_elt = PROTECT(ScalarReal((double) b->nselected));
+	SET_VECTOR_ELT(ans, 4, ans_elt);
+	UNPROTECT(1);
+
+	UNPROTECT(1);
+	return ans;
+}
+
+
+/****************************************************************************
+ * RLIter: walks on the runs of an RLindex
+ *
+ * Bitmap tiles are walked on as runs of consecutive set bits.
+ */
+
+typedef struct rl_iter_t {
+	const double *run_start, *run_width;
+	R_xlen_t nrun, i;
+	const double *tile_start;
+	const unsigned int *tile_words;
+	R_xlen_t ntile, j;
+	int bit;  /* next bit to look at in tile 'j' */
+} RLIter;
+
+static void RLIter_init(RLIter *it, SEXP parts)
+{
+	SEXP run_start, run_width, tile_start, tile_bits;
+
+	if (!(isVectorList(parts) && LENGTH(parts) == 5))
+		error("S4Arrays internal error in RLIter_init(): "
+		      "'parts' must be a list of length 5");
+	run_start = VECTOR_ELT(parts, 0);
+	run_width = VECTOR_ELT(parts, 1);
+	tile_start = VECTOR_ELT(parts, 2);
+	tile_bits = VECTOR_ELT(parts, 3);
+	if (!(IS_NUMERIC(run_start) && IS_NUMERIC(run_width) &&
+	      XLENGTH(run_start) == XLENGTH(run_width) &&
+	      IS_NUMERIC(tile_start) && IS_INTEGER(tile_bits) &&
+	      XLENGTH(tile_bits) == TILE_NWORD * XLENGTH(tile_start)))
+		error("invalid RLindex object");
+	it->run_start = REAL(run_start);
+	it->run_width = REAL(run_width);
+	it->nrun = XLENGTH(run_start);
+	it->i = 0;
+	it->tile_start = REAL(tile_start);
+	it->tile_words = (const unsigned int *) INTEGER(tile_bits);
+	it->ntile = XLENGTH(tile_start);
+	it->j = 0;
+	it->bit = 0;
+	return;
+}
+
+static double get_nselected(SEXP parts)
+{
+	return REAL(VECTOR_ELT(parts, 4))[0];
+}
+
+/* Returns the position of the first bit >= 'from' that is set (if 'val'
+   is 1) or not set (if 'val' is 0), or TILE_NBIT if there is none. */
+static int next_bit(const unsigned int *words, int from, unsigned int val)
+{
+	unsigned int w, skip;
+	int k;
+
+	skip = val ? 0U : ~0U;
+	for (k = from; k < TILE_NBIT; k++) {
+		w = words[k >> 5];
+		if ((k & 31) == 0 && w == skip) {
+			k += 31;
+			continue;
+		}
+		if (((w >> (k & 31)) & 1U) == val)
+			return k;
+	}
+	return TILE_NBIT;
+}
+
+/* Returns 0 when there are no more runs. Otherwise stores the 0-based start
+   and width of the next run in '*start' and '*width', and returns 1. */
+static int RLIter_next(RLIter *it, long long int *start, long long int *width)
+{
+	long long int tile_off;
+	const unsigned int *words;
+	int b, e;
+
+	while (it->j < it->ntile) {
+		tile_off = (long long int) it->tile_start[it->j] - 1;
+		if (it->bit == 0 && it->i < it->nrun &&
+		    (long long int) it->run_start[it->i] - 1 < tile_off)
+			break;  /* next run comes before tile 'j' */
+		words = it->tile_words + TILE_NWORD * it->j;
+		b = next_bit(words, it->bit, 1U);
+		if (b == TILE_NBIT) {
+			it->j++;
+			it->bit = 0;
+			continue;
+		}
+		e = next_bit(words, b, 0U);
+		it->bit = e;
+		*start = tile_off + b;
+		*width = e - b;
+		return 1;
+	}
+	if (it->i >= it->nrun)
+		return 0;
+	*start = (long long int) it->run_start[it->i] - 1;
+	*width = (long long int) it->run_width[it->i];
+	it->i++;
+	return 1;
+}
+
+
+/****************************************************************************
+ * Convert back and forth between RLindex and Lindex/Mindex
+ */
+
+static int compar_llints(const void *p1, const void *p2)
+{
+	long long int x1 = *((const long long int *) p1),
+		      x2 = *((const long long int *) p2);
+
+	return (x1 > x2) - (x1 < x2);
+}
+
+/* Returns the 0-based linear index. */
+static long long int get_Lindex_elt(SEXP Lindex, R_xlen_t k,
+				    long long int dim_prod)
+{
+	int v;
+	double d;
+
+	if (IS_INTEGER(Lindex)) {
+		v = INTEGER(Lindex)[k];
+		if (v != NA_INTEGER && v >= 1 && v <= dim_prod)
+			return (long long int) v - 1;
+	} else {
+		d = REAL(Lindex)[k];
+		if (!ISNAN(d) && d >= 1 && d < (double) dim_prod + 1)
+			return (long long int) d - 1;
+	}
+	error("Lindex[%lld] is NA or < 1 or > prod(dim)",
+	      (long long int) k + 1);
+	return -1;  /* will never reach this */
+}
+
+/* 'x' must contain 0-based linear indices. Sorts them in place if they are
+   not sorted already. */
+static SEXP build_from_llints(long long int *x, R_xlen_t n)
+{
+	RLBuilder b;
+	R_xlen_t k;
+	long long int prev;
+
+	for (k = 1; k < n; k++) {
+		if (x[k] < x[k - 1]) {
+			qsort(x, n, sizeof(long long int), compar_llints);
+			break;
+		}
+	}
+	RLBuilder_init(&b);
+	prev = -1;
+	for (k = 0; k < n; k++) {
+		if (x[k] == prev)
+			continue;  /* skip duplicates */
+		prev = x[k];
+		RLBuilder_add_run(&b, prev, 1);
+	}
+	return RLBuilder_finish(&b);
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_Lindex2RLindex(SEXP Lindex, SEXP dim)
+{
+	long long int dim_prod, x, prev, start, *buf;
+	R_xlen_t n, k, i;
+	RLBuilder b;
+
+	if (!IS_INTEGER(dim))
+		error("'dim' must be an integer vector");
+	dim_prod = safe_dim_prod(INTEGER(dim), LENGTH(dim));
+	if (!(IS_INTEGER(Lindex) || IS_NUMERIC(Lindex)))
+		error("'Lindex' must be an integer (or numeric) vector");
+	n = XLENGTH(Lindex);
+
+	/* Fast path for the common case of a sorted Lindex (e.g. as
+	   returned by which()): the elements are checked and turned into
+	   runs in a single pass, and 'Lindex' is not copied. */
+	RLBuilder_init(&b);
+	start = prev = -1;
+	for (k = 0; k < n; k++) {
+		x = get_Lindex_elt(Lindex, k, dim_prod);
+		if (x == prev)
+			continue;
+		if (x < prev)
+			break;
+		if (start < 0 || x != prev + 1) {
+			if (start >= 0)
+				RLBuilder_add_run(&b, start, prev - start + 1);
+			start = x;
+		}
+		prev = x;
+	}
+	if (k == n) {
+		if (start >= 0)
+			RLBuilder_add_run(&b, start, prev - start + 1);
+		return RLBuilder_finish(&b);
+	}
+
+	/* 'Lindex' is not sorted: sort a copy of it. Only the elements
+	   before the 1st unsorted one get read twice. */
+	buf = (long long int *) R_alloc(n, sizeof(long long int));
+	for (i = 0; i < n; i++)
+		buf[i] = get_Lindex_elt(Lindex, i, dim_prod);
+	return build_from_llints(buf, n);
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_Mindex2RLindex(SEXP Mindex, SEXP dim)
+{
+	SEXP Mindex_dim;
+	int ndim, along, d, m;
+	const int *M;
+	R_xlen_t nrow, i;
+	long long int *buf, x;
+
+	if (!IS_INTEGER(dim))
+		error("'dim' must be an integer vector");
+	ndim = LENGTH(dim);
+	safe_dim_prod(INTEGER(dim), ndim);  /* check 'dim' */
+	Mindex_dim = GET_DIM(Mindex);
+	if (!(IS_INTEGER(Mindex) && Mindex_dim != R_NilValue &&
+	      LENGTH(Mindex_dim) == 2))
+		error("'Mindex' must be an integer matrix");
+	if (INTEGER(Mindex_dim)[1] != ndim)
+		error("'Mindex' must have one column per dimension");
+	nrow = INTEGER(Mindex_dim)[0];
+	M = INTEGER(Mindex);
+	buf = (long long int *) R_alloc(nrow, sizeof(long long int));
+	for (i = 0; i < nrow; i++) {
+		x = 0;
+		for (along = ndim - 1; along >= 0; along--) {
+			d = INTEGER(dim)[along];
+			m = M[i + nrow * along];
+			if (INVALID_COORD(m, d))
+				error("Mindex[%lld, %d] is NA or < 1 "
+				      "or > dim[%d]",
+				      (long long int) i + 1, along + 1,
+				      along + 1);
+			x = x * d + m - 1;
+		}
+		buf[i] = x;
+	}
+	return build_from_llints(buf, nrow);
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_mask2RLindex(SEXP mask)
+{
+	const int *m;
+	R_xlen_t n, k, k0;
+	RLBuilder b;
+
+	if (!IS_LOGICAL(mask))
+		error("'mask' must be a logical vector or array");
+	m = LOGICAL(mask);
+	n = XLENGTH(mask);
+	RLBuilder_init(&b);
+	k = 0;
+	while (k < n) {
+		/* NAs are treated as FALSE (like which() does). */
+		if (m[k] == NA_LOGICAL || m[k] == 0) {
+			k++;
+			continue;
+		}
+		k0 = k;
+		while (k < n && m[k] != NA_LOGICAL && m[k] != 0)
+			k++;
+		RLBuilder_add_run(&b, (long long int) k0, k - k0);
+	}
+	return RLBuilder_finish(&b);
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_RLindex2Lindex(SEXP parts, SEXP dim)
+{
+	RLIter it;
+	double nselected;
+	long long int dim_prod, start, width, x;
+	R_xlen_t off;
+	SEXP ans;
+
+	RLIter_init(&it, parts);
+	if (!IS_INTEGER(dim))
+		error("'dim' must be an integer vector");
+	dim_prod = safe_dim_prod(INTEGER(dim), LENGTH(dim));
+	nselected = get_nselected(parts);
+	if (nselected > (double) R_XLEN_T_MAX)
+		error("too many selected elements to be "
+		      "represented as an L-index");
+	ans = PROTECT(allocVector(dim_prod <= INT_MAX ? INTSXP : REALSXP,
+				  (R_xlen_t) nselected));
+	off = 0;
+	while (RLIter_next(&it, &start, &width)) {
+		if (start + width > dim_prod || off + width > XLENGTH(ans)) {
+			UNPROTECT(1);
+			error("invalid RLindex object");
+		}
+		if (IS_INTEGER(ans)) {
+			for (x = start; x < start + width; x++)
+				INTEGER(ans)[off++] = (int) x + 1;
+		} else {
+			for (x = start; x < start + width; x++)
+				REAL(ans)[off++] = (double) x + 1.0;
+		}
+	}
+	if (off != XLENGTH(ans)) {
+		UNPROTECT(1);
+		error("invalid RLindex object");
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_RLindex2Mindex(SEXP parts, SEXP dim)
+{
+	RLIter it;
+	double nselected;
+	int ndim, along, nrow, *coords;
+	long long int dim_prod, start, width, x;
+	R_xlen_t i;
+	SEXP ans;
+
+	RLIter_init(&it, parts);
+	if (!IS_INTEGER(dim))
+		error("'dim' must be an integer vector");
+	ndim = LENGTH(dim);
+	dim_prod = safe_dim_prod(INTEGER(dim), ndim);
+	nselected = get_nselected(parts);
+	if (nselected > (double) INT_MAX)
+		error("too many selected elements to be "
+		      "represented as an M-index");
+	nrow = (int) nselected;
+	ans = PROTECT(allocMatrix(INTSXP, nrow, ndim));
+	coords = (int *) R_alloc(ndim, sizeof(int));
+	i = 0;
+	while (RLIter_next(&it, &start, &width)) {
+		if (start + width > dim_prod || i + width > nrow) {
+			UNPROTECT(1);
+			error("invalid RLindex object");
+		}
+		/* Coordinates (0-based) of the 1st element in the run. */
+		x = start;
+		for (along = 0; along < ndim; along++) {
+			coords[along] = (int) (x % INTEGER(dim)[along]);
+			x /= INTEGER(dim)[along];
+		}
+		for (x = 0; x < width; x++, i++) {
+			for (along = 0; along < ndim; along++)
+				INTEGER(ans)[i + (R_xlen_t) nrow * along] =
+					coords[along] + 1;
+			/* Move to the next element. */
+			for (along = 0; along < ndim; along++) {
+				if (++coords[along] < INTEGER(dim)[along])
+					break;
+				coords[along] = 0;
+			}
+		}
+	}
+	if (i != nrow) {
+		UNPROTECT(1);
+		error("invalid RLindex object");
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+
+/****************************************************************************
+ * Set operations
+ */
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_RLindex_union(SEXP parts1, SEXP parts2)
+{
+	RLIter it1, it2;
+	RLBuilder b;
+	long long int s1, w1, s2, w2, s, e, cur_s, cur_e;
+	int have1, have2, have_cur;
+
+	RLIter_init(&it1, parts1);
+	RLIter_init(&it2, parts2);
+	RLBuilder_init(&b);
+	have1 = RLIter_next(&it1, &s1, &w1);
+	have2 = RLIter_next(&it2, &s2, &w2);
+	have_cur = 0;
+	cur_s = cur_e = 0;
+	while (have1 || have2) {
+		if (have1 && (!have2 || s1 <= s2)) {
+			s = s1;
+			e = s1 + w1;
+			have1 = RLIter_next(&it1, &s1, &w1);
+		} else {
+			s = s2;
+			e = s2 + w2;
+			have2 = RLIter_next(&it2, &s2, &w2);
+		}
+		if (have_cur && s <= cur_e) {
+			if (e > cur_e)
+				cur_e = e;
+			continue;
+		}
+		if (have_cur)
+			RLBuilder_add_run(&b, cur_s, cur_e - cur_s);
+		cur_s = s;
+		cur_e = e;
+		have_cur = 1;
+	}
+	if (have_cur)
+		RLBuilder_add_run(&b, cur_s, cur_e - cur_s);
+	return RLBuilder_finish(&b);
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_RLindex_intersect(SEXP parts1, SEXP parts2)
+{
+	RLIter it1, it2;
+	RLBuilder b;
+	long long int s1, w1, s2, w2, s, e;
+	int have1, have2;
+
+	RLIter_init(&it1, parts1);
+	RLIter_init(&it2, parts2);
+	RLBuilder_init(&b);
+	have1 = RLIter_next(&it1, &s1, &w1);
+	have2 = RLIter_next(&it2, &s2, &w2);
+	while (have1 && have2) {
+		s = s1 > s2 ? s1 : s2;
+		e = s1 + w1 < s2 + w2 ? s1 + w1 : s2 + w2;
+		if (s < e)
+			RLBuilder_add_run(&b, s, e - s);
+		if (s1 + w1 <= s2 + w2) {
+			have1 = RLIter_next(&it1, &s1, &w1);
+		} else {
+			have2 = RLIter_next(&it2, &s2, &w2);
+		}
+	}
+	return RLBuilder_finish(&b);
+}
+
+
+/****************************************************************************
+ * Extraction
+ */
+
+static void copy_run(SEXP x, R_xlen_t x_off, SEXP ans, R_xlen_t ans_off,
+		     R_xlen_t n)
+{
+	R_xlen_t k;
+
+	switch (TYPEOF(x)) {
+	    case LGLSXP: case INTSXP:
+		memcpy(INTEGER(ans) + ans_off, INTEGER(x) + x_off,
+		       sizeof(int) * n);
+		return;
+	    case REALSXP:
+		memcpy(REAL(ans) + ans_off, REAL(x) + x_off,
+		       sizeof(double) * n);
+		return;
+	    case CPLXSXP:
+		memcpy(COMPLEX(ans) + ans_off, COMPLEX(x) + x_off,
+		       sizeof(Rcomplex) * n);
+		return;
+	    case RAWSXP:
+		memcpy(RAW(ans) + ans_off, RAW(x) + x_off, n);
+		return;
+	    case STRSXP:
+		for (k = 0; k < n; k++)
+			SET_STRING_ELT(ans, ans_off + k,
+				       STRING_ELT(x, x_off + k));
+		return;
+	    case VECSXP:
+		for (k = 0; k < n; k++)
+			SET_VECTOR_ELT(ans, ans_off + k,
+				       VECTOR_ELT(x, x_off + k));
+		return;
+	}
+	error("S4Arrays internal error in copy_run(): "
+	      "type \"%s\" is not supported", type2char(TYPEOF(x)));
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_subset_by_RLindex(SEXP x, SEXP parts)
+{
+	RLIter it;
+	long long int start, width;
+	R_xlen_t ans_len, off;
+	SEXP ans;
+
+	RLIter_init(&it, parts);
+	switch (TYPEOF(x)) {
+	    case LGLSXP: case INTSXP: case REALSXP: case CPLXSXP:
+	    case RAWSXP: case STRSXP: case VECSXP:
+		break;
+	    default:
+		error("'x' must be an ordinary vector or array");
+	}
+	ans_len = (R_xlen_t) get_nselected(parts);
+	ans = PROTECT(allocVector(TYPEOF(x), ans_len));
+	off = 0;
+	/* Whole runs are copied at once. */
+	while (RLIter_next(&it, &start, &width)) {
+		if (start + width > XLENGTH(x) || off + width > ans_len) {
+			UNPROTECT(1);
+			error("the RLindex object is out of bounds");
+		}
+		copy_run(x, (R_xlen_t) start, ans, off, (R_xlen_t) width);
+		off += width;
+	}
+	if (off != ans_len) {
+		UNPROTECT(1);
+		error("invalid RLindex object");
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+
+/****************************************************************************
+ * Split an RLindex by the blocks of an ArrayGrid
+ */
+
+typedef struct grid_t {
+	int ndim;
+	const int *refdim;
+	long long int refdim_prod;
+	const int **tm;           /* tickmarks along each dimension */
+	int *ntm;                 /* number of tickmarks along each dimension */
+	int **block_along;        /* block index along each dimension of
+				     each coordinate (0-based) */
+	long long int *bstride;   /* strides of the grid of blocks */
+} Grid;
+
+static void init_Grid(Grid *grid, SEXP refdim, SEXP tickmarks)
+{
+	int ndim, along, d, bk, i, prev_tm, tm;
+	SEXP tm_along;
+
+	if (!IS_INTEGER(refdim))
+		error("'refdim' must be an integer vector");
+	ndim = LENGTH(refdim);
+	if (ndim == 0)
+		error("the RLindex object must have at least one dimension");
+	grid->refdim_prod = safe_dim_prod(INTEGER(refdim), ndim);
+	if (!(isVectorList(tickmarks) && LENGTH(tickmarks) == ndim))
+		error("'tickmarks' must be a list with one element "
+		      "per dimension");
+	grid->ndim = ndim;
+	grid->refdim = INTEGER(refdim);
+	grid->tm = (const int **) R_alloc(ndim, sizeof(int *));
+	grid->ntm = (int *) R_alloc(ndim, sizeof(int));
+	grid->block_along = (int **) R_alloc(ndim, sizeof(int *));
+	grid->bstride = (long long int *) R_alloc(ndim,
+						  sizeof(long long int));
+	for (along = 0; along < ndim; along++) {
+		d = INTEGER(refdim)[along];
+		tm_along = VECTOR_ELT(tickmarks, along);
+		if (!IS_INTEGER(tm_along))
+			error("'tickmarks' must be a list of integer vectors");
+		grid->tm[along] = INTEGER(tm_along);
+		grid->ntm[along] = LENGTH(tm_along);
+		grid->bstride[along] = along == 0 ? 1 :
+			grid->bstride[along - 1] * grid->ntm[along - 1];
+		if (grid->bstride[along] * grid->ntm[along] > INT_MAX)
+			error("the grid has too many blocks");
+		grid->block_along[along] = (int *) R_alloc(d, sizeof(int));
+		prev_tm = 0;
+		i = 0;
+		for (bk = 0; bk < grid->ntm[along]; bk++) {
+			tm = grid->tm[along][bk];
+			if (tm == NA_INTEGER || tm < prev_tm || tm > d)
+				error("invalid tickmarks along "
+				      "dimension %d", along + 1);
+			for (; i < tm; i++)
+				grid->block_along[along][i] = bk;
+			prev_tm = tm;
+		}
+		if (i != d)
+			error("the tickmarks along dimension %d "
+			      "don't cover the array", along + 1);
+	}
+	return;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_split_RLindex_by_grid(SEXP parts, SEXP refdim, SEXP tickmarks)
+{
+	Grid grid;
+	RLIter it;
+	RLBuilder *builders;
+	int ndim, along, nblock, ntouched, buflen, bk, block_id, *builder_idx,
+	    *coords, k;
+	long long int start, width, x, len, avail, bstart, bend,
+		      local_x, local_stride;
+	SEXP ans, ans_ids, ans_dims, ans_parts;
+
+	init_Grid(&grid, refdim, tickmarks);
+	ndim = grid.ndim;
+	nblock = (int) (grid.bstride[ndim - 1] * grid.ntm[ndim - 1]);
+	builder_idx = (int *) R_alloc(nblock, sizeof(int));
+	for (block_id = 0; block_id < nblock; block_id++)
+		builder_idx[block_id] = -1;
+	coords = (int *) R_alloc(ndim, sizeof(int));
+	builders = NULL;
+	ntouched = buflen = 0;
+
+	RLIter_init(&it, parts);
+	while (RLIter_next(&it, &start, &width)) {
+		if (start + width > grid.refdim_prod)
+			error("the RLindex object is out of bounds");
+		while (width > 0) {
+			/* Coordinates of 'start' and the block they
+			   belong to. */
+			x = start;
+			block_id = 0;
+			for (along = 0; along < ndim; along++) {
+				coords[along] = (int)
+					(x % grid.refdim[along]);
+				x /= grid.refdim[along];
+				bk = grid.block_along[along][coords[along]];
+				block_id += (int) (bk * grid.bstride[along]);
+			}
+			/* Length of the longest piece of the run that
+			   starts at 'start', stays in the block, and is
+			   contiguous in the block. Along the first
+			   dimensions that are fully covered by the block,
+			   the piece can span multiple "rows". */
+			len = 1;
+			for (along = 0; along < ndim - 1; along++) {
+				bk = grid.block_along[along][coords[along]];
+				if (coords[along] != 0 ||
+				    grid.tm[along][bk] != grid.refdim[along])
+					break;
+				len *= grid.refdim[along];
+			}
+			bk = grid.block_along[along][coords[along]];
+			avail = (grid.tm[along][bk] - coords[along]) * len;
+			if (avail > width)
+				avail = width;
+			/* Local (0-based) linear index in the block. */
+			local_x = 0;
+			local_stride = 1;
+			for (along = 0; along < ndim; along++) {
+				bk = grid.block_along[along][coords[along]];
+				bstart = bk == 0 ? 0 : grid.tm[along][bk - 1];
+				bend = grid.tm[along][bk];
+				local_x += (coords[along] - bstart) *
+					   local_stride;
+				local_stride *= bend - bstart;
+			}
+			k = builder_idx[block_id];
+			if (k < 0) {
+				if (ntouched == buflen) {
+					buflen = buflen == 0 ? 16 : 2 * buflen;
+					builders = grow_buf(builders,
+						sizeof(RLBuilder) * ntouched,
+						sizeof(RLBuilder) * buflen);
+				}
+				k = builder_idx[block_id] = ntouched++;
+				RLBuilder_init(builders + k);
+			}
+			RLBuilder_add_run(builders + k, local_x, avail);
+			start += avail;
+			width -= avail;
+		}
+	}
+
+	/* Return the touched blocks in increasing order. */
+	ans_ids = PROTECT(NEW_INTEGER(ntouched));
+	ans_dims = PROTECT(allocMatrix(INTSXP, ntouched, ndim));
+	ans_parts = PROTECT(NEW_LIST(ntouched));
+	k = 0;
+	for (block_id = 0; block_id < nblock; block_id++) {
+		if (builder_idx[block_id] < 0)
+			continue;
+		INTEGER(ans_ids)[k] = block_id + 1;
+		for (along = 0; along < ndim; along++) {
+			bk = (int) (block_id / grid.bstride[along] %
+				    grid.ntm[along]);
+			bstart = bk == 0 ? 0 : grid.tm[along][bk - 1];
+			INTEGER(ans_dims)[k + (R_xlen_t) ntouched * along] =
+				(int) (grid.tm[along][bk] - bstart);
+		}
+		SET_VECTOR_ELT(ans_parts, k,
+			RLBuilder_finish(builders + builder_idx[block_id]));
+		k++;
+	}
+	ans = PROTECT(NEW_LIST(3));
+	SET_VECTOR_ELT(ans, 0, ans_ids);
+	SET_VECTOR_ELT(ans, 1, ans_dims);
+	SET_VECTOR_ELT(ans, 2, ans_parts);
+	UNPROTECT(4);
+	return ans;
+}
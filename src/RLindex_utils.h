@@ -0,0 +1,28 @@
+#ifndef _RLINDEX_UTILS_H_
+#define _RLINDEX_UTILS_H_
+
+#include <Rdefines.h>
+
+SEXP C_Lindex2RLindex(SEXP Lindex, SEXP dim);
+
+SEXP C_Mindex2RLindex(SEXP Mindex, SEXP dim);
+
+SEXP C_mask2RLindex(SEXP mask);
+
+SEXP C_RLindex2Lindex(SEXP parts, SEXP dim);
+
+SEXP C_RLindex2Mindex(SEXP parts, SEXP dim);
+
+SEXP C_RLindex_union(SEXP parts1, SEXP parts2);
+
+SEXP C_RLindex_intersect(SEXP parts1, SEXP parts2);
+
+SEXP C_subset_by_RLindex(SEXP x, SEXP parts);
+
+SEXP C_split_RLindex_by_grid(
+	SEXP parts,
+	SEXP refdim,
+	SEXP tickmarks
+);
+
+#endif  /* _RLINDEX_UTILS_H_ */
@@ -3,6 +3,14 @@
 #include "abind.h"
 #include "array_selection.h"
 #include "dim_tuning_utils.h"
+#include "Nindex_utils.h"
+#include "block_io_profiling.h"
+#include "grid_traversal.h"
+#include "thread_control.h"
+#include "reduce_by_block.h"
+#include "block_density.h"
+#include "chunked_compressed_array.h"
+#include "RLindex_utils.h"
 
 #define CALLMETHOD_DEF(fun, numArgs) {#fun, (DL_FUNC) &fun, numArgs}
 
@@ -19,6 +27,45 @@ static const R_CallMethodDef callMethods[] = {
 	CALLMETHOD_DEF(C_tune_dims, 2),
 	CALLMETHOD_DEF(C_tune_dimnames, 2),
 
+/* Nindex_utils.c */
+	CALLMETHOD_DEF(C_normalize_subscript, 3),
+
+/* block_io_profiling.c */
+	CALLMETHOD_DEF(C_block_io_clock, 0),
+	CALLMETHOD_DEF(C_record_block_io, 5),
+	CALLMETHOD_DEF(C_get_block_io_profile, 0),
+	CALLMETHOD_DEF(C_reset_block_io_profile, 0),
+
+/* grid_traversal.c */
+	CALLMETHOD_DEF(C_grid_traversal_order, 4),
+
+/* thread_control.c */
+	CALLMETHOD_DEF(C_get_max_nthread, 0),
+
+/* reduce_by_block.c */
+	CALLMETHOD_DEF(C_reduce_dense_block, 5),
+
+/* block_density.c */
+	CALLMETHOD_DEF(C_count_nonzero_elts, 2),
+
+/* chunked_compressed_array.c */
+	CALLMETHOD_DEF(C_open_CCA_sink, 7),
+	CALLMETHOD_DEF(C_write_CCA_chunk, 3),
+	CALLMETHOD_DEF(C_close_CCA_sink, 1),
+	CALLMETHOD_DEF(C_read_CCA_header, 1),
+	CALLMETHOD_DEF(C_extract_CCA_array, 4),
+
+/* RLindex_utils.c */
+	CALLMETHOD_DEF(C_Lindex2RLindex, 2),
+	CALLMETHOD_DEF(C_Mindex2RLindex, 2),
+	CALLMETHOD_DEF(C_mask2RLindex, 1),
+	CALLMETHOD_DEF(C_RLindex2Lindex, 2),
+	CALLMETHOD_DEF(C_RLindex2Mindex, 2),
+	CALLMETHOD_DEF(C_RLindex_union, 2),
+	CALLMETHOD_DEF(C_RLindex_intersect, 2),
+	CALLMETHOD_DEF(C_subset_by_RLindex, 2),
+	CALLMETHOD_DEF(C_split_RLindex_by_grid, 3),
+
 	{NULL, NULL, 0}
 };
 
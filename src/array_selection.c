@@ -156,7 +156,7 @@ static int get_matrix_nrow_ncol(SEXP m, int *nrow, int *ncol)
 	return -1;
 }
 
-static long long int safe_dim_prod(const int *dim, int ndim)
+long long int safe_dim_prod(const int *dim, int ndim)
 {
 	long long int prod;
 	int i, d;
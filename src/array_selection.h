@@ -6,6 +6,8 @@
 #define	INVALID_COORD(coord, maxcoord) \
 	((coord) == NA_INTEGER || (coord) < 1 || (coord) > (maxcoord))
 
+long long int safe_dim_prod(const int *dim, int ndim);
+
 SEXP C_Lindex2Mindex(SEXP Lindex, SEXP dim, SEXP use_names);
 SEXP C_Mindex2Lindex(SEXP Mindex, SEXP dim, SEXP use_names, SEXP as_integer);
 
@@ -0,0 +1,71 @@
+/****************************************************************************
+ *              Counting the nonzero elements of a dense block              *
+ ****************************************************************************/
+#include "block_density.h"
+
+/*
+  Used by read_block(x, viewport, as.sparse="auto") to decide whether a dense
+  block should be turned into a sparse one or not. Because this decision only
+  requires knowing whether the number of nonzero elements is below some
+  threshold or not, the count stops as soon as it reaches 'max_count'.
+  What is considered a zero is consistent with what the SparseArray package
+  does: FALSE, 0L, 0.0, 0+0i, as.raw(0), and the empty string. Note that NAs
+  and NaNs are nonzero elements.
+*/
+
+#define	COUNT_NONZERO_ELTS(x_len, is_nonzero_expr)		\
+{								\
+	for (k = 0; k < x_len && count < max_count0; k++)	\
+		if (is_nonzero_expr)				\
+			count++;				\
+}
+
+/* --- .Call ENTRY POINT ---
+   'x': An ordinary vector or array.
+   'max_count': A single double.
+   Returns the number of nonzero elements in 'x' or 'max_count', whichever
+   is smaller, as a double. Returns NA_real_ if 'x' is of a type for which
+   the notion of zero is not defined (e.g. list). */
+SEXP C_count_nonzero_elts(SEXP x, SEXP max_count)
+{
+	R_xlen_t x_len, k;
+	double max_count0, count;
+	const int *ix;
+	const double *dx;
+	const Rcomplex *cx;
+	const Rbyte *rx;
+
+	if (!(IS_NUMERIC(max_count) && LENGTH(max_count) == 1))
+		error("'max_count' must be a single double");
+	max_count0 = REAL(max_count)[0];
+	if (ISNAN(max_count0))
+		error("'max_count' cannot be NA or NaN");
+	x_len = XLENGTH(x);
+	count = 0.0;
+	switch (TYPEOF(x)) {
+	    case LGLSXP: case INTSXP:
+		ix = TYPEOF(x) == INTSXP ? INTEGER(x) : LOGICAL(x);
+		COUNT_NONZERO_ELTS(x_len, ix[k] != 0);
+		break;
+	    case REALSXP:
+		dx = REAL(x);
+		COUNT_NONZERO_ELTS(x_len, dx[k] != 0.0);
+		break;
+	    case CPLXSXP:
+		cx = COMPLEX(x);
+		COUNT_NONZERO_ELTS(x_len, cx[k].r != 0.0 || cx[k].i != 0.0);
+		break;
+	    case RAWSXP:
+		rx = RAW(x);
+		COUNT_NONZERO_ELTS(x_len, rx[k] != 0);
+		break;
+	    case STRSXP:
+		COUNT_NONZERO_ELTS(x_len,
+				   STRING_ELT(x, k) == NA_STRING ||
+				   LENGTH(STRING_ELT(x, k)) != 0);
+		break;
+	    default:
+		return ScalarReal(NA_REAL);
+	}
+	return ScalarReal(count);
+}
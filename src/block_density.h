@@ -0,0 +1,11 @@
+#ifndef _BLOCK_DENSITY_H_
+#define _BLOCK_DENSITY_H_
+
+#include <Rdefines.h>
+
+SEXP C_count_nonzero_elts(
+	SEXP x,
+	SEXP max_count
+);
+
+#endif  /* _BLOCK_DENSITY_H_ */
@@ -0,0 +1,201 @@
+/****************************************************************************
+ *                           Block I/O profiling                            *
+ ****************************************************************************/
+#include "block_io_profiling.h"
+
+#include <string.h>  /* for strncmp(), strncpy() */
+#include <math.h>    /* for log2() */
+#include <time.h>    /* for clock_gettime() */
+
+/*
+  The profiling data is aggregated at the C level in a small static table
+  with one entry per (op, class) pair, where 'op' is the block I/O operation
+  that was profiled (read_block, write_block, extract_array, or
+  read_block_as_dense), and 'class' is the class of the array-like object
+  that the operation was performed on. Each entry keeps track of the number
+  of calls, total wall time, total number of bytes moved, time spent in
+  each stage of the operation, and a histogram of the lengths of the blocks
+  (using powers of 2 as bin boundaries). Recording a call is O(1) (plus a
+  linear lookup in the table, which is expected to stay very small) and
+  doesn't allocate anything. Profiling must never make the profiled
+  operation fail, so when the table is full, the calls for new (op, class)
+  pairs are dropped and only counted.
+*/
+
+#define	MAX_NENTRY            256
+#define	CLASS_NAME_BUFSIZE    128
+
+/* Must match .BLOCK_IO_STAGES in R/block_io_profiling.R */
+#define	NSTAGE                  5
+
+/* Bin 0 is for empty blocks. Bin k (k >= 1) is for blocks of length
+   >= 2^(k-1) and < 2^k. The last bin also collects all the blocks that
+   are longer than that. */
+#define	NBIN                   48
+
+typedef struct profile_entry_t {
+	int op;
+	char class_name[CLASS_NAME_BUFSIZE];
+	int ncall;
+	double elapsed;
+	double nbytes;
+	double stage_times[NSTAGE];
+	int block_len_hist[NBIN];
+} ProfileEntry;
+
+static ProfileEntry profile_entries[MAX_NENTRY];
+static int nentry = 0;
+static double ndropped = 0;
+
+/* Returns NULL if the table is full. */
+static ProfileEntry *get_profile_entry(int op, const char *class_name)
+{
+	int i;
+	ProfileEntry *entry;
+
+	for (i = 0; i < nentry; i++) {
+		entry = profile_entries + i;
+		if (entry->op == op &&
+		    strncmp(entry->class_name, class_name,
+			    CLASS_NAME_BUFSIZE - 1) == 0)
+			return entry;
+	}
+	if (nentry == MAX_NENTRY)
+		return NULL;
+	entry = profile_entries + nentry++;
+	memset(entry, 0, sizeof(ProfileEntry));
+	entry->op = op;
+	strncpy(entry->class_name, class_name, CLASS_NAME_BUFSIZE - 1);
+	return entry;
+}
+
+static inline int block_len_to_bin(double block_len)
+{
+	int bin;
+
+	if (block_len < 1.0)
+		return 0;
+	bin = (int) log2(block_len) + 1;
+	return bin < NBIN ? bin : NBIN - 1;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_block_io_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ScalarReal((double) ts.tv_sec + 1e-9 * (double) ts.tv_nsec);
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_record_block_io(SEXP op, SEXP class_name, SEXP block_len,
+		       SEXP nbytes, SEXP stage_times)
+{
+	ProfileEntry *entry;
+	const double *times;
+	double t;
+	int s;
+
+	if (!IS_INTEGER(op) || LENGTH(op) != 1)
+		error("'op' must be a single integer");
+	if (!IS_CHARACTER(class_name) || LENGTH(class_name) != 1)
+		error("'class_name' must be a single string");
+	if (!IS_NUMERIC(stage_times) || LENGTH(stage_times) != NSTAGE)
+		error("'stage_times' must be a numeric vector "
+		      "of length %d", NSTAGE);
+	entry = get_profile_entry(INTEGER(op)[0],
+				  CHAR(STRING_ELT(class_name, 0)));
+	if (entry == NULL) {
+		ndropped++;
+		return R_NilValue;
+	}
+	entry->ncall++;
+	times = REAL(stage_times);
+	for (s = 0; s < NSTAGE; s++) {
+		t = times[s];
+		if (ISNAN(t))
+			continue;
+		entry->stage_times[s] += t;
+		entry->elapsed += t;
+	}
+	entry->nbytes += asReal(nbytes);
+	entry->block_len_hist[block_len_to_bin(asReal(block_len))]++;
+	return R_NilValue;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_get_block_io_profile(void)
+{
+	SEXP ans, ans_elt;
+	int i, s, b;
+	const ProfileEntry *entry;
+
+	ans = PROTECT(NEW_LIST(8));
+
+	ans_elt = PROTECT(NEW_INTEGER(nentry));
+	for (i = 0; i < nentry; i++)
+		INTEGER(ans_elt)[i] = profile_entries[i].op;
+	SET_VECTOR_ELT(ans, 0, ans_elt);
+	UNPROTECT(1);
+
+	ans_elt = PROTECT(NEW_CHARACTER(nentry));
+	for (i = 0; i < nentry; i++)
+		SET_STRING_ELT(ans_elt, i,
+			       mkChar(profile_entries[i].class_name));
+	SET_VECTOR_ELT(ans, 1, ans_elt);
+	UNPROTECT(1);
+
+	ans_elt = PROTECT(NEW_INTEGER(nentry));
+	for (i = 0; i < nentry; i++)
+		INTEGER(ans_elt)[i] = profile_entries[i].ncall;
+	SET_VECTOR_ELT(ans, 2, ans_elt);
+	UNPROTECT(1);
+
+	ans_elt = PROTECT(NEW_NUMERIC(nentry));
+	for (i = 0; i < nentry; i++)
+		REAL(ans_elt)[i] = profile_entries[i].elapsed;
+	SET_VECTOR_ELT(ans, 3, ans_elt);
+	UNPROTECT(1);
+
+	ans_elt = PROTECT(NEW_NUMERIC(nentry));
+	for (i = 0; i < nentry; i++)
+		REAL(ans_elt)[i] = profile_entries[i].nbytes;
+	SET_VECTOR_ELT(ans, 4, ans_elt);
+	UNPROTECT(1);
+
+	ans_elt = PROTECT(allocMatrix(REALSXP, nentry, NSTAGE));
+	for (i = 0; i < nentry; i++) {
+		entry = profile_entries + i;
+		for (s = 0; s < NSTAGE; s++)
+			REAL(ans_elt)[i + s * nentry] = entry->stage_times[s];
+	}
+	SET_VECTOR_ELT(ans, 5, ans_elt);
+	UNPROTECT(1);
+
+	ans_elt = PROTECT(allocMatrix(INTSXP, nentry, NBIN));
+	for (i = 0; i < nentry; i++) {
+		entry = profile_entries + i;
+		for (b = 0; b < NBIN; b++)
+			INTEGER(ans_elt)[i + b * nentry] =
+				entry->block_len_hist[b];
+	}
+	SET_VECTOR_ELT(ans, 6, ans_elt);
+	UNPROTECT(1);
+
+	ans_elt = PROTECT(ScalarReal(ndropped));
+	SET_VECTOR_ELT(ans, 7, ans_elt);
+	UNPROTECT(1);
+
+	UNPROTECT(1);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_reset_block_io_profile(void)
+{
+	nentry = 0;
+	ndropped = 0;
+	return R_NilValue;
+}
+
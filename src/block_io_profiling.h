@@ -0,0 +1,20 @@
+#ifndef _BLOCK_IO_PROFILING_H_
+#define _BLOCK_IO_PROFILING_H_
+
+#include <Rdefines.h>
+
+SEXP C_block_io_clock(void);
+
+SEXP C_record_block_io(
+	SEXP op,
+	SEXP class_name,
+	SEXP block_len,
+	SEXP nbytes,
+	SEXP stage_times
+);
+
+SEXP C_get_block_io_profile(void);
+
+SEXP C_reset_block_io_profile(void);
+
+#endif  /* _BLOCK_IO_PROFILING_H_ */
@@ -0,0 +1,1182 @@
+/****************************************************************************
+ *               Chunked compressed arrays (the CCA format)                 *
+ ****************************************************************************/
+#include "chunked_compressed_array.h"
+
+#include "thread_control.h"
+
+#include <zlib.h>
+#include <stdio.h>
+#include <stdlib.h>  /* for malloc(), free() */
+#include <string.h>  /* for memcpy(), memset(), memcmp() */
+#include <stdint.h>  /* for int32_t, int64_t */
+#include <pthread.h>
+#ifndef _WIN32
+#include <signal.h>  /* for sigfillset(), pthread_sigmask() */
+#endif
+
+/*
+  A CCA file stores an array of type "logical", "integer", "double",
+  "complex", or "raw", split into chunks. The chunks are defined by a grid
+  (the grid used for writing the array), are compressed independently with
+  zlib, and are stored in the order in which they were written. An index
+  located at the end of the file gives the offset and size of each chunk,
+  so reading a block only requires decompressing the chunks that overlap
+  with it.
+
+  File layout (all integers are stored in the native byte order, which is
+  checked when the file is opened for reading):
+
+      8 bytes       "S4ACCA01"
+      int32         0x01020304 (byte order mark)
+      int32         type code (see below)
+      int32         shuffle (0 or 1)
+      int32         ndim
+      int32[ndim]   dim
+      for each dimension:
+        int32       number of chunks along the dimension
+        int32[]     tickmarks along the dimension (like the 'tickmarks'
+                    slot of an ArbitraryArrayGrid object)
+      ...           the compressed chunks
+      int64[N]      offsets of the chunks (-1 for chunks that were never
+                    written, which are read as zeros)
+      int64[N]      compressed sizes of the chunks
+      int64         offset of the index
+      8 bytes       "S4ACCAIX"
+
+  where N is the total number of chunks. The chunks are numbered in the
+  column-major order of the grid.
+
+  If 'shuffle' is 1, the bytes of the elements of a chunk are shuffled
+  before compression (i.e. all the 1st bytes of the elements come first,
+  then all the 2nd bytes, etc...). This groups together the bytes that are
+  likely to be similar (e.g. the high-order bytes of small integers) and
+  usually makes numeric data a lot more compressible.
+
+  Compression is performed in the background by a pool of POSIX threads
+  (see "Writing" below). Decompression is performed in parallel with OpenMP.
+*/
+
+#define	CCA_MAGIC        "S4ACCA01"
+#define	CCA_INDEX_MAGIC  "S4ACCAIX"
+#define	CCA_BOM          0x01020304
+
+#define	CCA_LOGICAL      1
+#define	CCA_INTEGER      2
+#define	CCA_DOUBLE       3
+#define	CCA_COMPLEX      4
+#define	CCA_RAW          5
+
+#ifdef _WIN32
+#define	cca_fseek _fseeki64
+#define	cca_ftell _ftelli64
+#else
+#define	cca_fseek fseeko
+#define	cca_ftell ftello
+#endif
+
+/* Returns 0 if 'type' is not supported. */
+static int lookup_type_code(const char *type)
+{
+	if (strcmp(type, "logical") == 0)
+		return CCA_LOGICAL;
+	if (strcmp(type, "integer") == 0)
+		return CCA_INTEGER;
+	if (strcmp(type, "double") == 0)
+		return CCA_DOUBLE;
+	if (strcmp(type, "complex") == 0)
+		return CCA_COMPLEX;
+	if (strcmp(type, "raw") == 0)
+		return CCA_RAW;
+	return 0;
+}
+
+static int type_code_from_string(const char *type)
+{
+	int type_code;
+
+	type_code = lookup_type_code(type);
+	if (type_code != 0)
+		return type_code;
+	error("chunked compressed arrays only support types \"logical\", "
+	      "\"integer\", \"double\", \"complex\", and \"raw\"");
+	return 0;  /* will never reach this */
+}
+
+static const char *type_code_to_string(int type_code)
+{
+	switch (type_code) {
+	    case CCA_LOGICAL: return "logical";
+	    case CCA_INTEGER: return "integer";
+	    case CCA_DOUBLE:  return "double";
+	    case CCA_COMPLEX: return "complex";
+	    case CCA_RAW:     return "raw";
+	}
+	error("invalid chunked compressed array type code: %d", type_code);
+	return NULL;  /* will never reach this */
+}
+
+static SEXPTYPE type_code_to_Rtype(int type_code)
+{
+	switch (type_code) {
+	    case CCA_LOGICAL: return LGLSXP;
+	    case CCA_INTEGER: return INTSXP;
+	    case CCA_DOUBLE:  return REALSXP;
+	    case CCA_COMPLEX: return CPLXSXP;
+	}
+	return RAWSXP;
+}
+
+static size_t type_code_to_elt_size(int type_code)
+{
+	switch (type_code) {
+	    case CCA_LOGICAL: return sizeof(int);
+	    case CCA_INTEGER: return sizeof(int);
+	    case CCA_DOUBLE:  return sizeof(double);
+	    case CCA_COMPLEX: return sizeof(Rcomplex);
+	}
+	return sizeof(Rbyte);
+}
+
+static void *get_data_ptr(SEXP x)
+{
+	switch (TYPEOF(x)) {
+	    case LGLSXP:  return LOGICAL(x);
+	    case INTSXP:  return INTEGER(x);
+	    case REALSXP: return REAL(x);
+	    case CPLXSXP: return COMPLEX(x);
+	    case RAWSXP:  return RAW(x);
+	}
+	error("S4Arrays internal error in get_data_ptr(): "
+	      "unsupported type");
+	return NULL;  /* will never reach this */
+}
+
+static void shuffle_bytes(const unsigned char *in, unsigned char *out,
+			  size_t n, size_t elt_size)
+{
+	size_t i, b;
+
+	for (i = 0; i < n; i++)
+		for (b = 0; b < elt_size; b++)
+			out[b * n + i] = in[i * elt_size + b];
+	return;
+}
+
+static void unshuffle_bytes(const unsigned char *in, unsigned char *out,
+			    size_t n, size_t elt_size)
+{
+	size_t i, b;
+
+	for (b = 0; b < elt_size; b++)
+		for (i = 0; i < n; i++)
+			out[i * elt_size + b] = in[b * n + i];
+	return;
+}
+
+/* Total number of chunks and length of each chunk are computed from the
+   tickmarks. 'chunk_dim' must have room for 'ndim' ints. */
+static void get_chunk_dim(int ndim, const int *grid_dim,
+			  const int * const *tickmarks, R_xlen_t chunk_id,
+			  int *chunk_dim)
+{
+	int along, c;
+
+	for (along = 0; along < ndim; along++) {
+		c = chunk_id % grid_dim[along];
+		chunk_id /= grid_dim[along];
+		chunk_dim[along] = tickmarks[along][c] -
+				   (c == 0 ? 0 : tickmarks[along][c - 1]);
+	}
+	return;
+}
+
+static size_t get_chunk_len(int ndim, const int *chunk_dim)
+{
+	int along;
+	size_t len = 1;
+
+	for (along = 0; along < ndim; along++)
+		len *= chunk_dim[along];
+	return len;
+}
+
+
+/****************************************************************************
+ * Writing
+ *
+ * The chunks passed to the sink are compressed and appended to the file
+ * in the background by a pool of 'nthread' worker threads.
+ * C_write_CCA_chunk() only copies the chunk and puts it in a bounded queue,
+ * so the producer (typically the code that computes or reads the blocks)
+ * keeps running while the previous chunks are being compressed. It only
+ * waits when the queue is full. The workers don't use the R API.
+ */
+
+typedef struct queued_chunk_t {
+	R_xlen_t chunk_id;
+	size_t nelt;
+	unsigned char *data;   /* uncompressed data */
+} QueuedChunk;
+
+typedef struct cca_sink_t {
+	FILE *file;
+	int type_code;
+	size_t elt_size;
+	int shuffle;
+	int level;
+	int ndim;
+	int *grid_dim;
+	int **tickmarks;
+	R_xlen_t nchunk;
+	int64_t *offsets;      /* only modified with 'file_mutex' locked */
+	int64_t *sizes;        /* only modified with 'file_mutex' locked */
+	int nthread;
+	pthread_t *workers;
+	int nworker;           /* number of workers that were started */
+	int sync_ok;           /* 1 if the mutexes and conditions are set up */
+	pthread_mutex_t file_mutex;
+	/* 'mutex' protects the queue (a circular buffer), 'stopping',
+	   and 'status'. */
+	pthread_mutex_t mutex;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	QueuedChunk *queue;
+	int queue_cap;
+	int queue_head;
+	int queue_len;
+	int stopping;
+	int status;            /* zlib status code of the 1st failure */
+} CCASink;
+
+/* Does not use the R API so is safe to call from a worker thread.
+   On success, '*cdata' must be freed by the caller. */
+static int compress_chunk(const QueuedChunk *chunk, size_t elt_size,
+			  int shuffle, int level,
+			  unsigned char **cdata, size_t *csize)
+{
+	size_t nbytes;
+	const unsigned char *src;
+	unsigned char *buf;
+	uLongf destlen;
+	int status;
+
+	nbytes = chunk->nelt * elt_size;
+	src = chunk->data;
+	buf = NULL;
+	if (shuffle && elt_size > 1) {
+		buf = (unsigned char *) malloc(nbytes + 1);
+		if (buf == NULL)
+			return Z_MEM_ERROR;
+		shuffle_bytes(chunk->data, buf, chunk->nelt, elt_size);
+		src = buf;
+	}
+	destlen = compressBound((uLong) nbytes);
+	*cdata = (unsigned char *) malloc(destlen);
+	if (*cdata == NULL) {
+		free(buf);
+		return Z_MEM_ERROR;
+	}
+	status = compress2(*cdata, &destlen, src, (uLong) nbytes, level);
+	free(buf);
+	if (status != Z_OK) {
+		free(*cdata);
+		*cdata = NULL;
+		return status;
+	}
+	*csize = destlen;
+	return Z_OK;
+}
+
+/* Append a compressed chunk to the file and record its offset and size.
+   The file is flushed after each chunk so its content always reflects
+   the chunks written so far. Called by the workers. */
+static int append_chunk(CCASink *sink, R_xlen_t chunk_id,
+			const unsigned char *cdata, size_t csize)
+{
+	int64_t offset;
+	int status;
+
+	status = Z_OK;
+	pthread_mutex_lock(&sink->file_mutex);
+	offset = (int64_t) cca_ftell(sink->file);
+	if (offset < 0 || fwrite(cdata, 1, csize, sink->file) != csize ||
+	    fflush(sink->file) != 0)
+	{
+		status = Z_ERRNO;
+	} else {
+		sink->offsets[chunk_id] = offset;
+		sink->sizes[chunk_id] = (int64_t) csize;
+	}
+	pthread_mutex_unlock(&sink->file_mutex);
+	return status;
+}
+
+static void *compression_worker(void *arg)
+{
+	CCASink *sink = (CCASink *) arg;
+	QueuedChunk chunk;
+	unsigned char *cdata;
+	size_t csize;
+	int status;
+
+	while (1) {
+		pthread_mutex_lock(&sink->mutex);
+		while (sink->queue_len == 0 && !sink->stopping)
+			pthread_cond_wait(&sink->not_empty, &sink->mutex);
+		if (sink->queue_len == 0) {
+			/* 'stopping' is set and the queue is drained. */
+			pthread_mutex_unlock(&sink->mutex);
+			break;
+		}
+		chunk = sink->queue[sink->queue_head];
+		sink->queue_head = (sink->queue_head + 1) % sink->queue_cap;
+		sink->queue_len--;
+		/* After a failure, the remaining chunks are just dropped. */
+		status = sink->status;
+		pthread_cond_signal(&sink->not_full);
+		pthread_mutex_unlock(&sink->mutex);
+
+		if (status == Z_OK)
+			status = compress_chunk(&chunk, sink->elt_size,
+						sink->shuffle, sink->level,
+						&cdata, &csize);
+		free(chunk.data);
+		if (status == Z_OK) {
+			status = append_chunk(sink, chunk.chunk_id,
+					      cdata, csize);
+			free(cdata);
+		}
+		if (status != Z_OK) {
+			pthread_mutex_lock(&sink->mutex);
+			if (sink->status == Z_OK)
+				sink->status = status;
+			pthread_cond_broadcast(&sink->not_full);
+			pthread_mutex_unlock(&sink->mutex);
+		}
+	}
+	return NULL;
+}
+
+/* Signals are blocked in the workers so they're always delivered to the
+   main thread. Returns 0 if all the workers could be started. */
+static int start_workers(CCASink *sink)
+{
+	int i, ret;
+#ifndef _WIN32
+	sigset_t all_signals, old_signals;
+
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+#endif
+	ret = 0;
+	for (i = 0; i < sink->nthread; i++) {
+		ret = pthread_create(sink->workers + i, NULL,
+				     compression_worker, sink);
+		if (ret != 0)
+			break;
+		sink->nworker++;
+	}
+#ifndef _WIN32
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+#endif
+	return ret;
+}
+
+/* Wait for the workers to drain the queue and terminate. */
+static void stop_workers(CCASink *sink)
+{
+	int i;
+
+	if (sink->nworker == 0)
+		return;
+	pthread_mutex_lock(&sink->mutex);
+	sink->stopping = 1;
+	pthread_cond_broadcast(&sink->not_empty);
+	pthread_mutex_unlock(&sink->mutex);
+	for (i = 0; i < sink->nworker; i++)
+		pthread_join(sink->workers[i], NULL);
+	sink->nworker = 0;
+	return;
+}
+
+static void free_CCA_sink(CCASink *sink)
+{
+	int i, along;
+
+	stop_workers(sink);
+	if (sink->file != NULL) {
+		fclose(sink->file);
+		sink->file = NULL;
+	}
+	if (sink->queue != NULL) {
+		for (i = 0; i < sink->queue_len; i++)
+			free(sink->queue[(sink->queue_head + i) %
+					 sink->queue_cap].data);
+		free(sink->queue);
+	}
+	if (sink->sync_ok) {
+		pthread_mutex_destroy(&sink->file_mutex);
+		pthread_mutex_destroy(&sink->mutex);
+		pthread_cond_destroy(&sink->not_empty);
+		pthread_cond_destroy(&sink->not_full);
+	}
+	free(sink->workers);
+	if (sink->tickmarks != NULL) {
+		for (along = 0; along < sink->ndim; along++)
+			free(sink->tickmarks[along]);
+		free(sink->tickmarks);
+	}
+	free(sink->grid_dim);
+	free(sink->offsets);
+	free(sink->sizes);
+	free(sink);
+	return;
+}
+
+static CCASink *get_open_CCA_sink(SEXP sink_xp)
+{
+	CCASink *sink;
+
+	if (TYPEOF(sink_xp) != EXTPTRSXP)
+		error("'sink_xp' must be an external pointer");
+	sink = (CCASink *) R_ExternalPtrAddr(sink_xp);
+	if (sink == NULL || sink->file == NULL)
+		error("the ChunkedCompressedArraySink object is closed");
+	return sink;
+}
+
+static void raise_write_error(int status)
+{
+	if (status == Z_ERRNO)
+		error("failed to write compressed chunk to file");
+	if (status == Z_MEM_ERROR)
+		error("failed to allocate memory for the chunk");
+	error("zlib failed to compress chunk (error code %d)", status);
+}
+
+#define	WRITE_INT64(x, file)						\
+{									\
+	int64_t x64 = (int64_t) (x);					\
+	if (fwrite(&x64, sizeof(int64_t), 1, (file)) != 1)		\
+		goto on_write_error;					\
+}
+
+/* Wait for the workers to write the queued chunks, then write the chunk
+   index and close the file. Does not raise an error but returns a zlib
+   status code. The file is closed even if something goes wrong. */
+static int finish_CCA_sink(CCASink *sink)
+{
+	int status;
+	int64_t index_offset;
+	R_xlen_t i;
+
+	stop_workers(sink);
+	status = sink->status;
+	if (status != Z_OK)
+		goto done;
+	index_offset = (int64_t) cca_ftell(sink->file);
+	for (i = 0; i < sink->nchunk; i++)
+		WRITE_INT64(sink->offsets[i], sink->file);
+	for (i = 0; i < sink->nchunk; i++)
+		WRITE_INT64(sink->sizes[i], sink->file);
+	WRITE_INT64(index_offset, sink->file);
+	if (fwrite(CCA_INDEX_MAGIC, 1, 8, sink->file) != 8)
+		goto on_write_error;
+	goto done;
+
+    on_write_error:
+	status = Z_ERRNO;
+    done:
+	if (fclose(sink->file) != 0 && status == Z_OK)
+		status = Z_ERRNO;
+	sink->file = NULL;
+	return status;
+}
+
+/* A sink that gets garbage collected before it was closed is closed by
+   the finalizer, so the file is never left without a chunk index. */
+static void CCA_sink_finalizer(SEXP sink_xp)
+{
+	CCASink *sink = (CCASink *) R_ExternalPtrAddr(sink_xp);
+	int status;
+
+	if (sink == NULL)
+		return;
+	status = finish_CCA_sink(sink);
+	free_CCA_sink(sink);
+	R_ClearExternalPtr(sink_xp);
+	if (status != Z_OK)
+		warning("failed to close a ChunkedCompressedArraySink object "
+			"that was garbage collected before it was closed "
+			"(error code %d)", status);
+	return;
+}
+
+#define	WRITE_INT32(x, file)						\
+{									\
+	int32_t x32 = (int32_t) (x);					\
+	if (fwrite(&x32, sizeof(int32_t), 1, (file)) != 1)		\
+		goto on_write_error;					\
+}
+
+/* --- .Call ENTRY POINT ---
+   'tickmarks': A list of integer vectors (like the 'tickmarks' slot of an
+   ArbitraryArrayGrid object) that defines the chunks.
+   All the arguments are checked before anything is allocated or the file
+   is opened, so an invalid argument never leaks memory or a file handle. */
+SEXP C_open_CCA_sink(SEXP filepath, SEXP type, SEXP dim, SEXP tickmarks,
+		     SEXP shuffle, SEXP level, SEXP nthread)
+{
+	CCASink *sink;
+	const char *path;
+	int type_code, ndim, along, n, i;
+	const int *tm;
+	R_xlen_t nchunk;
+	SEXP tm_elt, ans;
+
+	if (!(IS_CHARACTER(filepath) && LENGTH(filepath) == 1))
+		error("'filepath' must be a single string");
+	if (!(IS_CHARACTER(type) && LENGTH(type) == 1))
+		error("'type' must be a single string");
+	type_code = type_code_from_string(CHAR(STRING_ELT(type, 0)));
+	if (!IS_INTEGER(dim))
+		error("'dim' must be an integer vector");
+	ndim = LENGTH(dim);
+	if (!(isVectorList(tickmarks) && LENGTH(tickmarks) == ndim))
+		error("'tickmarks' must be a list parallel to 'dim'");
+	nchunk = 1;
+	for (along = 0; along < ndim; along++) {
+		tm_elt = VECTOR_ELT(tickmarks, along);
+		if (!IS_INTEGER(tm_elt))
+			error("'tickmarks' must be a list of integer vectors");
+		nchunk *= LENGTH(tm_elt);
+	}
+	if (!(IS_LOGICAL(shuffle) && LENGTH(shuffle) == 1))
+		error("'shuffle' must be TRUE or FALSE");
+	if (!(IS_INTEGER(level) && LENGTH(level) == 1))
+		error("'level' must be a single integer");
+	if (!(IS_INTEGER(nthread) && LENGTH(nthread) == 1 &&
+	      INTEGER(nthread)[0] >= 1))
+		error("'nthread' must be a single positive integer");
+	path = translateChar(STRING_ELT(filepath, 0));
+
+	/* The external pointer is allocated first, so that nothing can fail
+	   once the sink is ready. */
+	ans = PROTECT(R_MakeExternalPtr(NULL, R_NilValue, R_NilValue));
+	R_RegisterCFinalizerEx(ans, CCA_sink_finalizer, TRUE);
+	sink = (CCASink *) calloc(1, sizeof(CCASink));
+	if (sink == NULL)
+		error("failed to allocate memory for the sink");
+	sink->type_code = type_code;
+	sink->elt_size = type_code_to_elt_size(type_code);
+	sink->shuffle = LOGICAL(shuffle)[0];
+	sink->level = INTEGER(level)[0];
+	sink->nthread = INTEGER(nthread)[0];
+	sink->ndim = ndim;
+	sink->nchunk = nchunk;
+	sink->status = Z_OK;
+	sink->grid_dim = (int *) calloc(ndim + 1, sizeof(int));
+	sink->tickmarks = (int **) calloc(ndim + 1, sizeof(int *));
+	sink->offsets = (int64_t *) malloc(nchunk * sizeof(int64_t) + 1);
+	sink->sizes = (int64_t *) malloc(nchunk * sizeof(int64_t) + 1);
+	sink->workers = (pthread_t *) calloc(sink->nthread, sizeof(pthread_t));
+	/* Room for 2 chunks per worker is enough to keep the workers busy. */
+	sink->queue_cap = 2 * sink->nthread;
+	sink->queue = (QueuedChunk *) calloc(sink->queue_cap,
+					     sizeof(QueuedChunk));
+	if (sink->grid_dim == NULL || sink->tickmarks == NULL ||
+	    sink->offsets == NULL || sink->sizes == NULL ||
+	    sink->workers == NULL || sink->queue == NULL)
+		goto on_alloc_error;
+	for (along = 0; along < ndim; along++) {
+		tm_elt = VECTOR_ELT(tickmarks, along);
+		n = LENGTH(tm_elt);
+		sink->grid_dim[along] = n;
+		sink->tickmarks[along] = (int *) malloc(n * sizeof(int) + 1);
+		if (sink->tickmarks[along] == NULL)
+			goto on_alloc_error;
+		memcpy(sink->tickmarks[along], INTEGER(tm_elt),
+		       n * sizeof(int));
+	}
+	for (i = 0; i < nchunk; i++) {
+		sink->offsets[i] = -1;
+		sink->sizes[i] = 0;
+	}
+
+	sink->file = fopen(path, "wb");
+	if (sink->file == NULL) {
+		free_CCA_sink(sink);
+		error("failed to open file '%s' for writing",
+		      CHAR(STRING_ELT(filepath, 0)));
+	}
+	if (fwrite(CCA_MAGIC, 1, 8, sink->file) != 8)
+		goto on_write_error;
+	WRITE_INT32(CCA_BOM, sink->file);
+	WRITE_INT32(sink->type_code, sink->file);
+	WRITE_INT32(sink->shuffle, sink->file);
+	WRITE_INT32(ndim, sink->file);
+	for (along = 0; along < ndim; along++)
+		WRITE_INT32(INTEGER(dim)[along], sink->file);
+	for (along = 0; along < ndim; along++) {
+		n = sink->grid_dim[along];
+		tm = sink->tickmarks[along];
+		WRITE_INT32(n, sink->file);
+		for (i = 0; i < n; i++)
+			WRITE_INT32(tm[i], sink->file);
+	}
+	if (fflush(sink->file) != 0)
+		goto on_write_error;
+
+	if (pthread_mutex_init(&sink->file_mutex, NULL) != 0)
+		goto on_thread_error;
+	if (pthread_mutex_init(&sink->mutex, NULL) != 0) {
+		pthread_mutex_destroy(&sink->file_mutex);
+		goto on_thread_error;
+	}
+	if (pthread_cond_init(&sink->not_empty, NULL) != 0) {
+		pthread_mutex_destroy(&sink->file_mutex);
+		pthread_mutex_destroy(&sink->mutex);
+		goto on_thread_error;
+	}
+	if (pthread_cond_init(&sink->not_full, NULL) != 0) {
+		pthread_mutex_destroy(&sink->file_mutex);
+		pthread_mutex_destroy(&sink->mutex);
+		pthread_cond_destroy(&sink->not_empty);
+		goto on_thread_error;
+	}
+	sink->sync_ok = 1;
+	if (start_workers(sink) != 0)
+		goto on_thread_error;
+	R_SetExternalPtrAddr(ans, sink);
+	UNPROTECT(1);
+	return ans;
+
+    on_alloc_error:
+	free_CCA_sink(sink);
+	error("failed to allocate memory for the sink");
+	return R_NilValue;  /* will never reach this */
+
+    on_write_error:
+	free_CCA_sink(sink);
+	error("failed to write header of file '%s'",
+	      CHAR(STRING_ELT(filepath, 0)));
+	return R_NilValue;  /* will never reach this */
+
+    on_thread_error:
+	free_CCA_sink(sink);
+	error("failed to start the compression threads");
+	return R_NilValue;  /* will never reach this */
+}
+
+/* --- .Call ENTRY POINT ---
+   'chunk_id': The 1-based linear index of the chunk in the grid.
+   'block': An ordinary array of the type of the sink, with the dimensions
+   of the chunk. */
+SEXP C_write_CCA_chunk(SEXP sink_xp, SEXP chunk_id, SEXP block)
+{
+	CCASink *sink;
+	R_xlen_t chunk_id0;
+	int *chunk_dim;
+	size_t nelt, nbytes;
+	QueuedChunk chunk;
+	int status;
+
+	sink = get_open_CCA_sink(sink_xp);
+	if (!(IS_NUMERIC(chunk_id) || IS_INTEGER(chunk_id)) ||
+	    LENGTH(chunk_id) != 1)
+		error("'chunk_id' must be a single number");
+	chunk_id0 = (R_xlen_t) asReal(chunk_id) - 1;
+	if (chunk_id0 < 0 || chunk_id0 >= sink->nchunk)
+		error("'chunk_id' is out of bounds");
+	if (TYPEOF(block) != type_code_to_Rtype(sink->type_code))
+		error("'block' must be of type \"%s\"",
+		      type_code_to_string(sink->type_code));
+	chunk_dim = (int *) R_alloc(sink->ndim, sizeof(int));
+	get_chunk_dim(sink->ndim, sink->grid_dim,
+		      (const int * const *) sink->tickmarks, chunk_id0,
+		      chunk_dim);
+	nelt = get_chunk_len(sink->ndim, chunk_dim);
+	if ((size_t) XLENGTH(block) != nelt)
+		error("'block' must have the length of the chunk");
+	nbytes = nelt * sink->elt_size;
+	if ((size_t) (uLong) nbytes != nbytes)
+		error("chunk is too big to be compressed with zlib");
+
+	chunk.chunk_id = chunk_id0;
+	chunk.nelt = nelt;
+	chunk.data = (unsigned char *) malloc(nbytes + 1);
+	if (chunk.data == NULL)
+		error("failed to allocate memory for the chunk");
+	if (nbytes != 0)
+		memcpy(chunk.data, get_data_ptr(block), nbytes);
+
+	/* Wait for a free slot in the queue. No R API calls from here. */
+	pthread_mutex_lock(&sink->mutex);
+	while (sink->queue_len == sink->queue_cap && sink->status == Z_OK)
+		pthread_cond_wait(&sink->not_full, &sink->mutex);
+	status = sink->status;
+	if (status == Z_OK) {
+		sink->queue[(sink->queue_head + sink->queue_len) %
+			    sink->queue_cap] = chunk;
+		sink->queue_len++;
+		pthread_cond_signal(&sink->not_empty);
+	}
+	pthread_mutex_unlock(&sink->mutex);
+	if (status != Z_OK) {
+		free(chunk.data);
+		raise_write_error(status);
+	}
+	return R_NilValue;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_close_CCA_sink(SEXP sink_xp)
+{
+	CCASink *sink;
+	int status;
+
+	sink = get_open_CCA_sink(sink_xp);
+	status = finish_CCA_sink(sink);
+	free_CCA_sink(sink);
+	R_ClearExternalPtr(sink_xp);
+	if (status == Z_ERRNO)
+		error("failed to write the compressed chunks or the chunk "
+		      "index to file");
+	if (status != Z_OK)
+		raise_write_error(status);
+	return R_NilValue;
+}
+
+
+/****************************************************************************
+ * Reading
+ */
+
+#define	READ_INT32(x, file)						\
+{									\
+	int32_t x32;							\
+	if (fread(&x32, sizeof(int32_t), 1, (file)) != 1)		\
+		goto on_read_error;					\
+	(x) = x32;							\
+}
+
+#define	READ_INT64(x, file)						\
+{									\
+	int64_t x64;							\
+	if (fread(&x64, sizeof(int64_t), 1, (file)) != 1)		\
+		goto on_read_error;					\
+	(x) = (double) x64;						\
+}
+
+static FILE *open_CCA_file(SEXP filepath)
+{
+	FILE *file;
+
+	if (!(IS_CHARACTER(filepath) && LENGTH(filepath) == 1))
+		error("'filepath' must be a single string");
+	file = fopen(translateChar(STRING_ELT(filepath, 0)), "rb");
+	if (file == NULL)
+		error("failed to open file '%s' for reading",
+		      CHAR(STRING_ELT(filepath, 0)));
+	return file;
+}
+
+/* --- .Call ENTRY POINT ---
+   Returns a list with 6 elements: type (single string), shuffle (TRUE or
+   FALSE), dim (integer vector), tickmarks (list of integer vectors),
+   offsets (double vector, -1 for chunks that were never written), and
+   sizes (double vector). */
+SEXP C_read_CCA_header(SEXP filepath)
+{
+	FILE *file;
+	char magic[8];
+	int bom, type_code, shuffle, ndim, along, n, i;
+	R_xlen_t nchunk, k;
+	double index_offset;
+	SEXP ans, ans_dim, ans_tickmarks, tm, ans_offsets, ans_sizes;
+
+	file = open_CCA_file(filepath);
+	ans = PROTECT(NEW_LIST(6));
+	if (fread(magic, 1, 8, file) != 8 || memcmp(magic, CCA_MAGIC, 8) != 0)
+		goto on_format_error;
+	READ_INT32(bom, file);
+	if (bom != CCA_BOM) {
+		fclose(file);
+		error("file '%s' was written on a platform with a different "
+		      "byte order", CHAR(STRING_ELT(filepath, 0)));
+	}
+	READ_INT32(type_code, file);
+	if (type_code < CCA_LOGICAL || type_code > CCA_RAW)
+		goto on_format_error;
+	READ_INT32(shuffle, file);
+	READ_INT32(ndim, file);
+	if (ndim < 1)
+		goto on_format_error;
+	SET_VECTOR_ELT(ans, 0, mkString(type_code_to_string(type_code)));
+	SET_VECTOR_ELT(ans, 1, ScalarLogical(shuffle != 0));
+	ans_dim = NEW_INTEGER(ndim);
+	SET_VECTOR_ELT(ans, 2, ans_dim);
+	for (along = 0; along < ndim; along++)
+		READ_INT32(INTEGER(ans_dim)[along], file);
+	ans_tickmarks = NEW_LIST(ndim);
+	SET_VECTOR_ELT(ans, 3, ans_tickmarks);
+	nchunk = 1;
+	for (along = 0; along < ndim; along++) {
+		READ_INT32(n, file);
+		if (n < 0)
+			goto on_format_error;
+		tm = NEW_INTEGER(n);
+		SET_VECTOR_ELT(ans_tickmarks, along, tm);
+		for (i = 0; i < n; i++)
+			READ_INT32(INTEGER(tm)[i], file);
+		nchunk *= n;
+	}
+
+	if (cca_fseek(file, -16, SEEK_END) != 0)
+		goto on_format_error;
+	READ_INT64(index_offset, file);
+	if (fread(magic, 1, 8, file) != 8 ||
+	    memcmp(magic, CCA_INDEX_MAGIC, 8) != 0)
+	{
+		fclose(file);
+		error("file '%s' has no chunk index (maybe the sink was not "
+		      "closed?)", CHAR(STRING_ELT(filepath, 0)));
+	}
+	if (cca_fseek(file, (int64_t) index_offset, SEEK_SET) != 0)
+		goto on_format_error;
+	ans_offsets = NEW_NUMERIC(nchunk);
+	SET_VECTOR_ELT(ans, 4, ans_offsets);
+	ans_sizes = NEW_NUMERIC(nchunk);
+	SET_VECTOR_ELT(ans, 5, ans_sizes);
+	for (k = 0; k < nchunk; k++)
+		READ_INT64(REAL(ans_offsets)[k], file);
+	for (k = 0; k < nchunk; k++)
+		READ_INT64(REAL(ans_sizes)[k], file);
+	fclose(file);
+	UNPROTECT(1);
+	return ans;
+
+    on_read_error:
+    on_format_error:
+	fclose(file);
+	error("file '%s' is not a valid chunked compressed array file",
+	      CHAR(STRING_ELT(filepath, 0)));
+	return R_NilValue;  /* will never reach this */
+}
+
+/* For each dimension, the selected positions are grouped by chunk. */
+typedef struct dim_selection_t {
+	int n;             /* number of selected positions */
+	int *inner;        /* offset within its chunk of each selected pos */
+	int *perm;         /* selected positions grouped by chunk */
+	int ntouched;      /* number of touched chunks */
+	int *touched;      /* touched chunks (0-based, sorted) */
+	int *touched_off;  /* 'perm[touched_off[t]:(touched_off[t+1]-1)]'
+			      are the selected positions in the t-th touched
+			      chunk */
+} DimSelection;
+
+/* 'subscript' must be NULL or an integer vector of valid 1-based indices
+   along the dimension. 'tm' are the tickmarks along the dimension. */
+static void make_DimSelection(DimSelection *sel, SEXP subscript, int d,
+			      const int *tm, int ntm)
+{
+	int i, val, c, lo, hi, mid, t;
+	int *chunk_of, *count;
+
+	sel->n = subscript == R_NilValue ? d : LENGTH(subscript);
+	sel->inner = (int *) R_alloc(sel->n + 1, sizeof(int));
+	sel->perm = (int *) R_alloc(sel->n + 1, sizeof(int));
+	chunk_of = (int *) R_alloc(sel->n + 1, sizeof(int));
+	count = (int *) R_alloc(ntm + 1, sizeof(int));
+	memset(count, 0, (ntm + 1) * sizeof(int));
+	for (i = 0; i < sel->n; i++) {
+		val = subscript == R_NilValue ? i + 1 : INTEGER(subscript)[i];
+		if (val == NA_INTEGER || val < 1 || val > d)
+			error("subscript contains out-of-bounds indices");
+		/* Find the 1st tickmark that is >= 'val'. */
+		lo = 0;
+		hi = ntm - 1;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (tm[mid] >= val)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		c = lo;
+		chunk_of[i] = c;
+		sel->inner[i] = val - 1 - (c == 0 ? 0 : tm[c - 1]);
+		count[c + 1]++;
+	}
+	/* Counting sort of the selected positions by chunk. */
+	sel->ntouched = 0;
+	for (c = 0; c < ntm; c++) {
+		if (count[c + 1] != 0)
+			sel->ntouched++;
+		count[c + 1] += count[c];
+	}
+	sel->touched = (int *) R_alloc(sel->ntouched + 1, sizeof(int));
+	sel->touched_off = (int *) R_alloc(sel->ntouched + 1, sizeof(int));
+	t = 0;
+	for (c = 0; c < ntm; c++) {
+		if (count[c + 1] == count[c])
+			continue;
+		sel->touched[t] = c;
+		sel->touched_off[t] = count[c];
+		t++;
+	}
+	sel->touched_off[t] = sel->n;
+	for (i = 0; i < sel->n; i++)
+		sel->perm[count[chunk_of[i]]++] = i;
+	return;
+}
+
+typedef struct touched_chunk_t {
+	int64_t offset;
+	size_t csize;
+	unsigned char *cdata;
+	int *tidx;  /* index of the chunk in 'sel[along].touched', per dim */
+	int status;
+} TouchedChunk;
+
+/* Decompress chunk 'chunk' and copy the selected elements to 'out'. Does
+   not use the R API so is safe to call from a worker thread. */
+static void scatter_touched_chunk(TouchedChunk *chunk, int ndim,
+				  const DimSelection *sel,
+				  const int *chunk_dim,
+				  const R_xlen_t *out_strides,
+				  size_t elt_size, int shuffle,
+				  unsigned char *out)
+{
+	size_t chunk_len, nbytes, in_off, out_off;
+	unsigned char *buf1, *buf2, *data;
+	uLongf destlen;
+	int along, *cursor, *lo, *hi, pos;
+	R_xlen_t cstride;
+
+	chunk_len = get_chunk_len(ndim, chunk_dim);
+	nbytes = chunk_len * elt_size;
+	buf1 = buf2 = NULL;
+	cursor = (int *) malloc(3 * ndim * sizeof(int));
+	if (cursor == NULL) {
+		chunk->status = Z_MEM_ERROR;
+		return;
+	}
+	lo = cursor + ndim;
+	hi = lo + ndim;
+	data = NULL;
+	if (chunk->offset >= 0) {
+		buf1 = (unsigned char *) malloc(nbytes + 1);
+		if (buf1 == NULL) {
+			chunk->status = Z_MEM_ERROR;
+			goto done;
+		}
+		destlen = nbytes;
+		chunk->status = uncompress(buf1, &destlen, chunk->cdata,
+					   (uLong) chunk->csize);
+		if (chunk->status != Z_OK)
+			goto done;
+		if (destlen != nbytes) {
+			chunk->status = Z_DATA_ERROR;
+			goto done;
+		}
+		data = buf1;
+		if (shuffle && elt_size > 1) {
+			buf2 = (unsigned char *) malloc(nbytes + 1);
+			if (buf2 == NULL) {
+				chunk->status = Z_MEM_ERROR;
+				goto done;
+			}
+			unshuffle_bytes(buf1, buf2, chunk_len, elt_size);
+			data = buf2;
+		}
+	}
+	/* Walk on all the combinations of selected positions that fall in
+	   this chunk. */
+	for (along = 0; along < ndim; along++) {
+		lo[along] = sel[along].touched_off[chunk->tidx[along]];
+		hi[along] = sel[along].touched_off[chunk->tidx[along] + 1];
+		cursor[along] = lo[along];
+	}
+	while (1) {
+		in_off = out_off = 0;
+		cstride = 1;
+		for (along = 0; along < ndim; along++) {
+			pos = sel[along].perm[cursor[along]];
+			out_off += pos * out_strides[along];
+			in_off += sel[along].inner[pos] * cstride;
+			cstride *= chunk_dim[along];
+		}
+		if (data == NULL) {
+			memset(out + out_off * elt_size, 0, elt_size);
+		} else {
+			memcpy(out + out_off * elt_size,
+			       data + in_off * elt_size, elt_size);
+		}
+		for (along = 0; along < ndim; along++) {
+			if (++cursor[along] < hi[along])
+				break;
+			cursor[along] = lo[along];
+		}
+		if (along == ndim)
+			break;
+	}
+	chunk->status = Z_OK;
+    done:
+	free(buf1);
+	free(buf2);
+	free(cursor);
+	return;
+}
+
+/* --- .Call ENTRY POINT ---
+   'header': The list returned by C_read_CCA_header().
+   'index': An unnamed list of subscripts as positive integer vectors, one
+   vector per dimension. Missing list elements are allowed and must be
+   represented by NULLs (same as for extract_array()).
+   Only the chunks that overlap with the selection are read and
+   decompressed. They are processed by batches of 'nthread' chunks: the
+   compressed data of the chunks in a batch is read sequentially, then the
+   chunks are decompressed and their selected elements copied to the result
+   in parallel. Note that 2 different chunks never contribute to the same
+   element of the result. */
+SEXP C_extract_CCA_array(SEXP filepath, SEXP header, SEXP index,
+			 SEXP nthread)
+{
+	SEXP x_dim, tickmarks, offsets, sizes, ans_dim, ans;
+	int type_code, shuffle, ndim, along, nthread0, *grid_dim, **tidxs,
+	    *chunk_dims, status, b, i;
+	size_t elt_size;
+	DimSelection *sel;
+	R_xlen_t *out_strides, ntouched, t, t2, chunk_id, grid_stride, batch_end;
+	TouchedChunk *chunks;
+	FILE *file;
+	unsigned char *out;
+
+	type_code = type_code_from_string(
+			CHAR(STRING_ELT(VECTOR_ELT(header, 0), 0)));
+	elt_size = type_code_to_elt_size(type_code);
+	shuffle = LOGICAL(VECTOR_ELT(header, 1))[0];
+	x_dim = VECTOR_ELT(header, 2);
+	tickmarks = VECTOR_ELT(header, 3);
+	offsets = VECTOR_ELT(header, 4);
+	sizes = VECTOR_ELT(header, 5);
+	ndim = LENGTH(x_dim);
+	if (!(isVectorList(index) && LENGTH(index) == ndim))
+		error("'index' must be a list with one element per dimension");
+	nthread0 = INTEGER(nthread)[0];
+
+	sel = (DimSelection *) R_alloc(ndim, sizeof(DimSelection));
+	grid_dim = (int *) R_alloc(ndim, sizeof(int));
+	out_strides = (R_xlen_t *) R_alloc(ndim, sizeof(R_xlen_t));
+	ans_dim = PROTECT(NEW_INTEGER(ndim));
+	ntouched = 1;
+	for (along = 0; along < ndim; along++) {
+		SEXP subscript = VECTOR_ELT(index, along);
+		SEXP tm = VECTOR_ELT(tickmarks, along);
+		if (subscript != R_NilValue && !IS_INTEGER(subscript))
+			error("the subscripts in 'index' must be NULLs "
+			      "or integer vectors");
+		grid_dim[along] = LENGTH(tm);
+		make_DimSelection(sel + along, subscript,
+				  INTEGER(x_dim)[along],
+				  INTEGER(tm), LENGTH(tm));
+		INTEGER(ans_dim)[along] = sel[along].n;
+		out_strides[along] = along == 0 ? 1 :
+			out_strides[along - 1] * sel[along - 1].n;
+		ntouched *= sel[along].ntouched;
+	}
+	ans = PROTECT(allocVector(type_code_to_Rtype(type_code),
+				  ntouched == 0 ? 0 :
+				  out_strides[ndim - 1] * sel[ndim - 1].n));
+	SET_DIM(ans, ans_dim);
+	if (ntouched == 0) {
+		UNPROTECT(2);
+		return ans;
+	}
+	out = (unsigned char *) get_data_ptr(ans);
+
+	/* Enumerate the touched chunks. */
+	chunks = (TouchedChunk *) R_alloc(ntouched, sizeof(TouchedChunk));
+	tidxs = (int **) R_alloc(ntouched, sizeof(int *));
+	chunk_dims = (int *) R_alloc(ntouched * ndim, sizeof(int));
+	for (t = 0; t < ntouched; t++) {
+		tidxs[t] = (int *) R_alloc(ndim, sizeof(int));
+		t2 = t;
+		chunk_id = 0;
+		grid_stride = 1;
+		for (along = 0; along < ndim; along++) {
+			int c, tm_c, tm_prev;
+			const int *tm = INTEGER(VECTOR_ELT(tickmarks, along));
+			tidxs[t][along] = t2 % sel[along].ntouched;
+			t2 /= sel[along].ntouched;
+			c = sel[along].touched[tidxs[t][along]];
+			chunk_id += c * grid_stride;
+			grid_stride *= grid_dim[along];
+			tm_c = tm[c];
+			tm_prev = c == 0 ? 0 : tm[c - 1];
+			chunk_dims[t * ndim + along] = tm_c - tm_prev;
+		}
+		chunks[t].offset = (int64_t) REAL(offsets)[chunk_id];
+		chunks[t].csize = (size_t) REAL(sizes)[chunk_id];
+		chunks[t].cdata = NULL;
+		chunks[t].tidx = tidxs[t];
+		chunks[t].status = Z_OK;
+	}
+
+	file = open_CCA_file(filepath);
+	for (t = 0; t < ntouched; t = batch_end) {
+		batch_end = t + nthread0;
+		if (batch_end > ntouched)
+			batch_end = ntouched;
+		/* Read the compressed data sequentially. */
+		status = Z_OK;
+		for (t2 = t; t2 < batch_end; t2++) {
+			TouchedChunk *chunk = chunks + t2;
+			if (chunk->offset < 0)
+				continue;
+			chunk->cdata = (unsigned char *)
+					malloc(chunk->csize + 1);
+			if (chunk->cdata == NULL) {
+				status = Z_MEM_ERROR;
+				break;
+			}
+			if (cca_fseek(file, chunk->offset, SEEK_SET) != 0 ||
+			    fread(chunk->cdata, 1, chunk->csize, file) !=
+			    chunk->csize)
+			{
+				status = Z_ERRNO;
+				break;
+			}
+		}
+		/* Decompress and scatter in parallel. */
+		if (status == Z_OK) {
+			b = (int) (batch_end - t);
+			#pragma omp parallel for num_threads(nthread0) \
+				schedule(dynamic)
+			for (i = 0; i < b; i++)
+				scatter_touched_chunk(chunks + t + i, ndim,
+					sel, chunk_dims + (t + i) * ndim,
+					out_strides, elt_size, shuffle, out);
+		}
+		for (t2 = t; t2 < batch_end; t2++) {
+			if (status == Z_OK && chunks[t2].status != Z_OK)
+				status = chunks[t2].status;
+			free(chunks[t2].cdata);
+			chunks[t2].cdata = NULL;
+		}
+		if (status != Z_OK) {
+			fclose(file);
+			if (status == Z_ERRNO)
+				error("failed to read compressed chunk "
+				      "from file");
+			error("zlib failed to decompress chunk "
+			      "(error code %d)", status);
+		}
+	}
+	fclose(file);
+	UNPROTECT(2);
+	return ans;
+}
@@ -0,0 +1,33 @@
+#ifndef _CHUNKED_COMPRESSED_ARRAY_H_
+#define _CHUNKED_COMPRESSED_ARRAY_H_
+
+#include <Rdefines.h>
+
+SEXP C_open_CCA_sink(
+	SEXP filepath,
+	SEXP type,
+	SEXP dim,
+	SEXP tickmarks,
+	SEXP shuffle,
+	SEXP level,
+	SEXP nthread
+);
+
+SEXP C_write_CCA_chunk(
+	SEXP sink_xp,
+	SEXP chunk_id,
+	SEXP block
+);
+
+SEXP C_close_CCA_sink(SEXP sink_xp);
+
+SEXP C_read_CCA_header(SEXP filepath);
+
+SEXP C_extract_CCA_array(
+	SEXP filepath,
+	SEXP header,
+	SEXP index,
+	SEXP nthread
+);
+
+#endif  /* _CHUNKED_COMPRESSED_ARRAY_H_ */
@@ -0,0 +1,294 @@
+/****************************************************************************
+ *               Locality-aware traversal orders for ArrayGrid              *
+ ****************************************************************************/
+#include "grid_traversal.h"
+
+#include <stdlib.h>  /* for qsort() */
+#include <string.h>  /* for strcmp() */
+#include <limits.h>  /* for INT_MAX */
+
+/*
+  The elements of an ArrayGrid object (i.e. the blocks) are identified by
+  their 1-based linear index in the grid (column-major order). A traversal
+  order is a permutation of these linear indices: the r-th element of the
+  permutation is the linear index of the block that gets visited at rank r.
+  All the non-trivial orders below are obtained by computing a sort key
+  for each block and sorting the blocks by key (ties are broken by linear
+  index so the sort is stable).
+
+  Supported orders:
+    o "column-major": The default order (identity permutation).
+    o "z-order":      Morton order. The key is obtained by interleaving
+                      the bits of the block coordinates, with the bits of
+                      the 1st dimension coming first at each bit level
+                      (i.e. the 1st dimension is the fastest moving).
+    o "hilbert":      N-dimensional Hilbert curve order. The key is
+                      computed with J. Skilling's algorithm (see
+                      "Programming the Hilbert curve", AIP Conference
+                      Proceedings 707, 2004).
+    o "chunk-major":  Visit all the blocks that start in the same chunk of
+                      the reference array before moving to the next chunk.
+                      Chunks are visited in column-major order, and so are
+                      the blocks within a chunk.
+
+  Dimensions of the grid with an extent of 1 don't contribute to the
+  "z-order" and "hilbert" keys so are ignored.
+*/
+
+typedef unsigned long long int key_t_;
+
+typedef struct keyed_block_t {
+	key_t_ key;
+	int idx;  /* 0-based linear index of the block in the grid */
+} KeyedBlock;
+
+static int compar_keyed_blocks(const void *p1, const void *p2)
+{
+	const KeyedBlock *b1 = (const KeyedBlock *) p1,
+			 *b2 = (const KeyedBlock *) p2;
+
+	if (b1->key != b2->key)
+		return b1->key < b2->key ? -1 : 1;
+	return b1->idx - b2->idx;
+}
+
+/* Number of bits needed to represent the coordinates along a dimension
+   of extent 'd' (i.e. values from 0 to d - 1). */
+static int nbits_for_extent(int d)
+{
+	int nbit = 0;
+	unsigned int x = d - 1;
+
+	while (x != 0) {
+		nbit++;
+		x >>= 1;
+	}
+	return nbit;
+}
+
+/* Interleave the 'nbit' lowest bits of 'X[0]', 'X[1]', ..., 'X[n-1]'.
+   If 'first_is_fastest' is TRUE then the bit from 'X[0]' is the least
+   significant at each bit level, otherwise it's the most significant. */
+static key_t_ interleave_bits(const unsigned int *X, int n, int nbit,
+			      int first_is_fastest)
+{
+	key_t_ key = 0;
+	int b, i, i2;
+
+	for (b = nbit - 1; b >= 0; b--) {
+		for (i = 0; i < n; i++) {
+			i2 = first_is_fastest ? n - 1 - i : i;
+			key = (key << 1) | ((X[i2] >> b) & 1U);
+		}
+	}
+	return key;
+}
+
+/* J. Skilling's AxestoTranspose(): transforms in-place the coordinates
+   'X[0..n-1]' of a point into the "transposed" Hilbert index. */
+static void axes_to_transpose(unsigned int *X, int n, int nbit)
+{
+	unsigned int M, P, Q, t;
+	int i;
+
+	M = 1U << (nbit - 1);
+	/* Inverse undo. */
+	for (Q = M; Q > 1; Q >>= 1) {
+		P = Q - 1;
+		for (i = 0; i < n; i++) {
+			if (X[i] & Q) {
+				X[0] ^= P;
+			} else {
+				t = (X[0] ^ X[i]) & P;
+				X[0] ^= t;
+				X[i] ^= t;
+			}
+		}
+	}
+	/* Gray encode. */
+	for (i = 1; i < n; i++)
+		X[i] ^= X[i - 1];
+	t = 0;
+	for (Q = M; Q > 1; Q >>= 1)
+		if (X[n - 1] & Q)
+			t ^= Q - 1;
+	for (i = 0; i < n; i++)
+		X[i] ^= t;
+	return;
+}
+
+/* Compute the "z-order" or "hilbert" keys. Only the "effective" dimensions
+   (i.e. with an extent > 1) are used. */
+static void compute_curve_keys(const int *grid_dim, int ndim, int hilbert,
+			       KeyedBlock *blocks, int nblock)
+{
+	int *coords, *eff_along, neff, nbit, along, i, j;
+	unsigned int *X;
+
+	coords = (int *) R_alloc(ndim, sizeof(int));
+	eff_along = (int *) R_alloc(ndim, sizeof(int));
+	X = (unsigned int *) R_alloc(ndim, sizeof(unsigned int));
+	neff = nbit = 0;
+	for (along = 0; along < ndim; along++) {
+		coords[along] = 0;
+		if (grid_dim[along] <= 1)
+			continue;
+		eff_along[neff++] = along;
+		j = nbits_for_extent(grid_dim[along]);
+		if (j > nbit)
+			nbit = j;
+	}
+	if (neff * nbit > (int) (8 * sizeof(key_t_)))
+		error("the grid has too many effective dimensions "
+		      "for this traversal order");
+	for (i = 0; i < nblock; i++) {
+		for (j = 0; j < neff; j++)
+			X[j] = (unsigned int) coords[eff_along[j]];
+		if (hilbert) {
+			if (nbit != 0)
+				axes_to_transpose(X, neff, nbit);
+			blocks[i].key = interleave_bits(X, neff, nbit, 0);
+		} else {
+			blocks[i].key = interleave_bits(X, neff, nbit, 1);
+		}
+		blocks[i].idx = i;
+		/* Move to the next block (column-major). */
+		for (along = 0; along < ndim; along++) {
+			if (++coords[along] < grid_dim[along])
+				break;
+			coords[along] = 0;
+		}
+	}
+	return;
+}
+
+/* Compute the "chunk-major" keys. 'block_starts' must be a list with one
+   integer vector per dimension containing the 0-based start of the blocks
+   along that dimension. The key of a block is the column-major linear
+   index of the chunk that contains the start of the block, in the grid
+   of chunks that contain the start of at least one block. */
+static void compute_chunk_keys(const int *grid_dim, int ndim,
+			       SEXP block_starts, const int *chunkdim,
+			       KeyedBlock *blocks, int nblock)
+{
+	int **chunk_ranks, *coords, along, d, cd, j, i;
+	const int *starts;
+	key_t_ key, p;
+
+	chunk_ranks = (int **) R_alloc(ndim, sizeof(int *));
+	for (along = 0; along < ndim; along++) {
+		d = grid_dim[along];
+		starts = INTEGER(VECTOR_ELT(block_starts, along));
+		cd = chunkdim[along];
+		chunk_ranks[along] = (int *) R_alloc(d, sizeof(int));
+		for (j = 0; j < d; j++) {
+			if (j == 0) {
+				chunk_ranks[along][j] = 0;
+				continue;
+			}
+			chunk_ranks[along][j] = chunk_ranks[along][j - 1] +
+				(starts[j] / cd != starts[j - 1] / cd);
+		}
+	}
+	coords = (int *) R_alloc(ndim, sizeof(int));
+	for (along = 0; along < ndim; along++)
+		coords[along] = 0;
+	for (i = 0; i < nblock; i++) {
+		key = 0;
+		p = 1;
+		for (along = 0; along < ndim; along++) {
+			d = grid_dim[along];
+			key += p * (key_t_) chunk_ranks[along][coords[along]];
+			p *= (key_t_) chunk_ranks[along][d - 1] + 1;
+		}
+		blocks[i].key = key;
+		blocks[i].idx = i;
+		for (along = 0; along < ndim; along++) {
+			if (++coords[along] < grid_dim[along])
+				break;
+			coords[along] = 0;
+		}
+	}
+	return;
+}
+
+/* --- .Call ENTRY POINT ---
+   'grid_dim': Integer vector containing the dimensions of the grid.
+   'order': Single string.
+   'block_starts', 'chunkdim': Used only when 'order' is "chunk-major".
+   Return an integer vector containing the 1-based linear indices of the
+   grid elements in the order in which they should be visited. */
+SEXP C_grid_traversal_order(SEXP grid_dim, SEXP order,
+			    SEXP block_starts, SEXP chunkdim)
+{
+	int ndim, along, d, nblock, i, is_chunk_major, is_hilbert;
+	long long int prod;
+	const char *order0;
+	KeyedBlock *blocks;
+	SEXP ans;
+
+	if (!IS_INTEGER(grid_dim))
+		error("'grid_dim' must be an integer vector");
+	if (!IS_CHARACTER(order) || LENGTH(order) != 1)
+		error("'order' must be a single string");
+	ndim = LENGTH(grid_dim);
+	prod = 1;
+	for (along = 0; along < ndim; along++) {
+		d = INTEGER(grid_dim)[along];
+		if (d == NA_INTEGER || d < 0)
+			error("'grid_dim' cannot contain NAs or negative values");
+		prod *= d;
+		if (prod > INT_MAX)
+			error("the grid has too many elements");
+	}
+	nblock = (int) prod;
+	order0 = CHAR(STRING_ELT(order, 0));
+	is_chunk_major = strcmp(order0, "chunk-major") == 0;
+	is_hilbert = strcmp(order0, "hilbert") == 0;
+
+	ans = PROTECT(NEW_INTEGER(nblock));
+	if (nblock == 0 || strcmp(order0, "column-major") == 0) {
+		for (i = 0; i < nblock; i++)
+			INTEGER(ans)[i] = i + 1;
+		UNPROTECT(1);
+		return ans;
+	}
+	if (!(is_chunk_major || is_hilbert || strcmp(order0, "z-order") == 0))
+		error("invalid traversal order: \"%s\"", order0);
+
+	blocks = (KeyedBlock *) R_alloc(nblock, sizeof(KeyedBlock));
+	if (is_chunk_major) {
+		if (!isVectorList(block_starts) ||
+		    LENGTH(block_starts) != ndim)
+			error("'block_starts' must be a list with one "
+			      "list element per dimension");
+		for (along = 0; along < ndim; along++) {
+			if (!IS_INTEGER(VECTOR_ELT(block_starts, along)) ||
+			    LENGTH(VECTOR_ELT(block_starts, along)) !=
+			    INTEGER(grid_dim)[along])
+				error("'block_starts[[%d]]' must be an integer "
+				      "vector of length 'grid_dim[%d]'",
+				      along + 1, along + 1);
+		}
+		if (!IS_INTEGER(chunkdim) || LENGTH(chunkdim) != ndim)
+			error("'chunkdim' must be an integer vector with "
+			      "one element per dimension");
+		for (along = 0; along < ndim; along++) {
+			d = INTEGER(chunkdim)[along];
+			if (d == NA_INTEGER || d < 1)
+				error("'chunkdim' cannot contain NAs "
+				      "or values < 1");
+		}
+		compute_chunk_keys(INTEGER(grid_dim), ndim, block_starts,
+				   INTEGER(chunkdim), blocks, nblock);
+	} else {
+		compute_curve_keys(INTEGER(grid_dim), ndim, is_hilbert,
+				   blocks, nblock);
+	}
+	qsort(blocks, nblock, sizeof(KeyedBlock), compar_keyed_blocks);
+	for (i = 0; i < nblock; i++)
+		INTEGER(ans)[i] = blocks[i].idx + 1;
+	UNPROTECT(1);
+	return ans;
+}
+
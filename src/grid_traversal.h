@@ -0,0 +1,13 @@
+#ifndef _GRID_TRAVERSAL_H_
+#define _GRID_TRAVERSAL_H_
+
+#include <Rdefines.h>
+
+SEXP C_grid_traversal_order(
+	SEXP grid_dim,
+	SEXP order,
+	SEXP block_starts,
+	SEXP chunkdim
+);
+
+#endif  /* _GRID_TRAVERSAL_H_ */
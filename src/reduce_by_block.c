@@ -0,0 +1,312 @@
+/****************************************************************************
+ *                 Multithreaded reduction of a dense block                 *
+ ****************************************************************************/
+#include "reduce_by_block.h"
+
+#include "thread_control.h"
+
+/*
+  C_reduce_dense_block() applies one or more reduction operations to a dense
+  block (i.e. to an ordinary array of type "logical", "integer", or "double")
+  in a single pass. The reductions are performed over the whole block and/or
+  along the margins specified in 'targets':
+    o target 0 means "reduce the whole block";
+    o target k >= 1 means "reduce along the k-th dimension of the block",
+      that is, produce one result per position along that dimension (e.g.
+      target 1 produces row reductions and target 2 column reductions when
+      the block is a matrix).
+  The result for each target is returned as a double matrix with one row per
+  "cell" (1 cell for target 0, or 'dim(block)[k]' cells for target k) and one
+  column per operation.
+
+  All the partial results are doubles:
+    o SUM_OP, SUM2_OP: Sum and sum of squares. Start at 0.
+    o MIN_OP, MAX_OP:  Start at Inf and -Inf, respectively.
+    o ANYNA_OP:        0 or 1.
+    o NZCOUNT_OP:      Number of nonzero values. NAs are counted as
+                       nonzero values unless 'na_rm' is TRUE.
+  When 'na_rm' is FALSE, the first NA (or NaN) value that is met by SUM_OP,
+  SUM2_OP, MIN_OP or MAX_OP is propagated to the result. This means that
+  the partial results produced by C_reduce_dense_block() can be merged with
+  simple vectorized operations at the R level (+, pmin, pmax).
+
+  The block is split into 'nthread' chunks of consecutive array elements
+  (using the column-major layout) that are processed in parallel. Each
+  thread walks on its chunk once and updates the partial results of all
+  the targets for each array element. It accumulates into its own private
+  buffer, and the buffers are merged at the end.
+*/
+
+/* Must match .REDUCTION_OPS in R/reduce_by_block.R */
+#define	SUM_OP      1
+#define	SUM2_OP     2
+#define	MIN_OP      3
+#define	MAX_OP      4
+#define	ANYNA_OP    5
+#define	NZCOUNT_OP  6
+
+static void init_acc(double *acc, R_xlen_t ncell, const int *ops, int nops)
+{
+	int o;
+	R_xlen_t cell;
+	double v;
+
+	for (o = 0; o < nops; o++) {
+		switch (ops[o]) {
+		    case MIN_OP: v = R_PosInf; break;
+		    case MAX_OP: v = R_NegInf; break;
+		    default:     v = 0.0;
+		}
+		for (cell = 0; cell < ncell; cell++)
+			acc[cell + o * ncell] = v;
+	}
+	return;
+}
+
+/* 'v' is the value to accumulate. 'is_na' must be set to 1 if 'v' is NA
+   or NaN, in which case 'v' must be NA_REAL or NaN. */
+static inline void update_acc(double *acc, R_xlen_t ncell, R_xlen_t cell,
+			      const int *ops, int nops,
+			      double v, int is_na, int na_rm)
+{
+	int o;
+	double *a;
+
+	for (o = 0; o < nops; o++) {
+		a = acc + cell + o * ncell;
+		switch (ops[o]) {
+		    case ANYNA_OP:
+			if (is_na)
+				*a = 1.0;
+			continue;
+		    case NZCOUNT_OP:
+			if (is_na ? !na_rm : v != 0.0)
+				*a += 1.0;
+			continue;
+		}
+		if (is_na) {
+			if (!na_rm && !ISNAN(*a))
+				*a = v;
+			continue;
+		}
+		if (ISNAN(*a))
+			continue;
+		switch (ops[o]) {
+		    case SUM_OP:  *a += v; break;
+		    case SUM2_OP: *a += v * v; break;
+		    case MIN_OP:  if (v < *a) *a = v; break;
+		    case MAX_OP:  if (v > *a) *a = v; break;
+		}
+	}
+	return;
+}
+
+/* Merge 'acc2' into 'acc1'. */
+static void merge_acc(double *acc1, const double *acc2, R_xlen_t ncell,
+		      const int *ops, int nops)
+{
+	int o;
+	R_xlen_t cell, i;
+	double *a1, a2;
+
+	for (o = 0; o < nops; o++) {
+		for (cell = 0; cell < ncell; cell++) {
+			i = cell + o * ncell;
+			a1 = acc1 + i;
+			a2 = acc2[i];
+			if (ops[o] == ANYNA_OP) {
+				if (a2 != 0.0)
+					*a1 = 1.0;
+				continue;
+			}
+			if (ops[o] == NZCOUNT_OP) {
+				*a1 += a2;
+				continue;
+			}
+			if (ISNAN(*a1))
+				continue;
+			if (ISNAN(a2)) {
+				*a1 = a2;
+				continue;
+			}
+			switch (ops[o]) {
+			    case SUM_OP: case SUM2_OP: *a1 += a2; break;
+			    case MIN_OP: if (a2 < *a1) *a1 = a2; break;
+			    case MAX_OP: if (a2 > *a1) *a1 = a2; break;
+			}
+		}
+	}
+	return;
+}
+
+/* Accumulate the array elements with linear indices >= 'k1' and < 'k2'
+   into the accumulators of all the targets at once. The accumulators of
+   target 'targets[i]' start at 'acc + acc_offs[i]' and have 'ncells[i]'
+   cells. The array coordinates of the current element are kept in
+   'coords' (must have room for 'ndim' ints) and stepped incrementally,
+   so the cell of each target is found without any division. */
+static void reduce_chunk(const int *ix, const double *dx,
+			 R_xlen_t k1, R_xlen_t k2,
+			 const int *block_dim, int ndim,
+			 const int *targets, int ntarget,
+			 const R_xlen_t *ncells, const R_xlen_t *acc_offs,
+			 const int *ops, int nops, int na_rm,
+			 double *acc, int *coords)
+{
+	R_xlen_t k, q, cell;
+	int along, i, is_na;
+	double v;
+
+	q = k1;
+	for (along = 0; along < ndim; along++) {
+		coords[along] = (int) (q % block_dim[along]);
+		q /= block_dim[along];
+	}
+	for (k = k1; k < k2; k++) {
+		if (dx != NULL) {
+			v = dx[k];
+			is_na = ISNAN(v);
+		} else if (ix[k] == NA_INTEGER) {
+			v = NA_REAL;
+			is_na = 1;
+		} else {
+			v = (double) ix[k];
+			is_na = 0;
+		}
+		for (i = 0; i < ntarget; i++) {
+			cell = targets[i] == 0 ? 0 : coords[targets[i] - 1];
+			update_acc(acc + acc_offs[i], ncells[i], cell,
+				   ops, nops, v, is_na, na_rm);
+		}
+		/* Step to the next array element. */
+		for (along = 0; along < ndim; along++) {
+			if (++coords[along] < block_dim[along])
+				break;
+			coords[along] = 0;
+		}
+	}
+	return;
+}
+
+/* Return a list parallel to 'targets'. */
+static SEXP reduce_block(SEXP block, const int *block_dim, int ndim,
+			 const int *targets, int ntarget,
+			 const int *ops, int nops,
+			 int na_rm, int nthread)
+{
+	R_xlen_t block_len, chunk_len, acc_len, *ncells, *acc_offs;
+	int i, t, *coords;
+	double *accs;
+	SEXPTYPE Rtype;
+	const int *ix;
+	const double *dx;
+	SEXP ans, ans_elt;
+
+	block_len = XLENGTH(block);
+	ncells = (R_xlen_t *) R_alloc(ntarget + 1, sizeof(R_xlen_t));
+	acc_offs = (R_xlen_t *) R_alloc(ntarget + 1, sizeof(R_xlen_t));
+	ans = PROTECT(NEW_LIST(ntarget));
+	acc_len = 0;
+	for (i = 0; i < ntarget; i++) {
+		ncells[i] = targets[i] == 0 ? 1 : block_dim[targets[i] - 1];
+		acc_offs[i] = acc_len;
+		acc_len += ncells[i] * nops;
+		ans_elt = allocMatrix(REALSXP, (int) ncells[i], nops);
+		SET_VECTOR_ELT(ans, i, ans_elt);
+		init_acc(REAL(ans_elt), ncells[i], ops, nops);
+	}
+	if (block_len == 0 || ntarget == 0) {
+		UNPROTECT(1);
+		return ans;
+	}
+	if ((R_xlen_t) nthread > block_len)
+		nthread = (int) block_len;
+
+	/* One private accumulation buffer (for all the targets) and one
+	   coordinates buffer per thread. */
+	accs = (double *) R_alloc(acc_len * nthread, sizeof(double));
+	for (t = 0; t < nthread; t++)
+		for (i = 0; i < ntarget; i++)
+			init_acc(accs + t * acc_len + acc_offs[i], ncells[i],
+				 ops, nops);
+	coords = (int *) R_alloc((size_t) ndim * nthread + 1, sizeof(int));
+
+	chunk_len = (block_len + nthread - 1) / nthread;
+	Rtype = TYPEOF(block);
+	ix = Rtype == REALSXP ? NULL : (Rtype == INTSXP ? INTEGER(block) :
+							    LOGICAL(block));
+	dx = Rtype == REALSXP ? REAL(block) : NULL;
+
+	#pragma omp parallel for num_threads(nthread) schedule(static)
+	for (t = 0; t < nthread; t++) {
+		R_xlen_t k1 = t * chunk_len,
+			 k2 = k1 + chunk_len;
+		if (k2 > block_len)
+			k2 = block_len;
+		reduce_chunk(ix, dx, k1, k2, block_dim, ndim,
+			     targets, ntarget, ncells, acc_offs,
+			     ops, nops, na_rm,
+			     accs + t * acc_len, coords + t * ndim);
+	}
+
+	for (t = 0; t < nthread; t++)
+		for (i = 0; i < ntarget; i++)
+			merge_acc(REAL(VECTOR_ELT(ans, i)),
+				  accs + t * acc_len + acc_offs[i],
+				  ncells[i], ops, nops);
+	UNPROTECT(1);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT ---
+   'block': An ordinary array of type "logical", "integer", or "double".
+   'ops': An integer vector of operation codes (see above).
+   'targets': An integer vector of targets (see above).
+   'na_rm': TRUE or FALSE.
+   'nthread': A single integer >= 1.
+   Return a list parallel to 'targets'. */
+SEXP C_reduce_dense_block(SEXP block, SEXP ops, SEXP targets,
+			  SEXP na_rm, SEXP nthread)
+{
+	SEXPTYPE Rtype;
+	SEXP block_dim;
+	int ndim, ntarget, nops, na_rm0, nthread0, i, target, o;
+	const int *ops0;
+
+	Rtype = TYPEOF(block);
+	if (Rtype != LGLSXP && Rtype != INTSXP && Rtype != REALSXP)
+		error("reduce_by_block() only supports blocks of type "
+		      "\"logical\", \"integer\", or \"double\"");
+	block_dim = GET_DIM(block);
+	if (block_dim == R_NilValue)
+		error("'block' must be an array");
+	ndim = LENGTH(block_dim);
+	if (!IS_INTEGER(ops))
+		error("'ops' must be an integer vector");
+	nops = LENGTH(ops);
+	ops0 = INTEGER(ops);
+	for (o = 0; o < nops; o++)
+		if (ops0[o] < SUM_OP || ops0[o] > NZCOUNT_OP)
+			error("'ops' contains invalid operation codes");
+	if (!IS_INTEGER(targets))
+		error("'targets' must be an integer vector");
+	ntarget = LENGTH(targets);
+	for (i = 0; i < ntarget; i++) {
+		target = INTEGER(targets)[i];
+		if (target == NA_INTEGER || target < 0 || target > ndim)
+			error("'targets' must contain values >= 0 "
+			      "and <= 'length(dim(block))'");
+	}
+	if (!(IS_LOGICAL(na_rm) && LENGTH(na_rm) == 1))
+		error("'na_rm' must be TRUE or FALSE");
+	na_rm0 = LOGICAL(na_rm)[0];
+	if (!(IS_INTEGER(nthread) && LENGTH(nthread) == 1))
+		error("'nthread' must be a single integer");
+	nthread0 = INTEGER(nthread)[0];
+	if (nthread0 == NA_INTEGER || nthread0 < 1)
+		error("'nthread' must be >= 1");
+
+	return reduce_block(block, INTEGER(block_dim), ndim,
+			    INTEGER(targets), ntarget,
+			    ops0, nops, na_rm0, nthread0);
+}
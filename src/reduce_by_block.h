@@ -0,0 +1,14 @@
+#ifndef _REDUCE_BY_BLOCK_H_
+#define _REDUCE_BY_BLOCK_H_
+
+#include <Rdefines.h>
+
+SEXP C_reduce_dense_block(
+	SEXP block,
+	SEXP ops,
+	SEXP targets,
+	SEXP na_rm,
+	SEXP nthread
+);
+
+#endif  /* _REDUCE_BY_BLOCK_H_ */
@@ -0,0 +1,33 @@
+/****************************************************************************
+ *                              Thread control                              *
+ ****************************************************************************/
+#include "thread_control.h"
+
+
+/* The number of available cores, capped by the OpenMP settings (e.g. the
+   OMP_NUM_THREADS and OMP_THREAD_LIMIT environment variables). Return 1
+   if the package was compiled without OpenMP support. */
+int get_max_nthread(void)
+{
+#ifdef _OPENMP
+	int n, limit;
+
+	n = omp_get_num_procs();
+	limit = omp_get_max_threads();
+	if (limit < n)
+		n = limit;
+	limit = omp_get_thread_limit();
+	if (limit < n)
+		n = limit;
+	return n >= 1 ? n : 1;
+#else
+	return 1;
+#endif
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_get_max_nthread(void)
+{
+	return ScalarInteger(get_max_nthread());
+}
+
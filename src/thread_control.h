@@ -0,0 +1,14 @@
+#ifndef _THREAD_CONTROL_H_
+#define _THREAD_CONTROL_H_
+
+#include <Rdefines.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+int get_max_nthread(void);
+
+SEXP C_get_max_nthread(void);
+
+#endif  /* _THREAD_CONTROL_H_ */